@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Compiles lambda calculus text to a Universal Lambda program.
+
+Usage: lamc.py source-file... > program
+
+The sources are read in order as one list of definitions, one per line
+(continued on the following indented lines):
+
+    name = term
+
+where a term is a lambda `\\x y. body`, an application `f x y`, `(term)`,
+a name (a variable or an earlier or later definition), `#N` (the Church
+numeral N) or `"text"` (a list of the numerals of its bytes, with
+Python escapes). `--` starts a comment. The definition of `main` is the
+program; the others are expanded into it.
+"""
+import re
+import sys
+
+sys.setrecursionlimit(20000)      # expand and Parser follow the terms
+
+TOKEN = re.compile(r'\\|\.|\(|\)|#\d+|"(?:[^"\\]|\\.)*"|[A-Za-z_][A-Za-z0-9_\']*|\S')
+
+
+class Parser:
+    def __init__(self, text):
+        self.tokens = TOKEN.findall(text)
+        self.pos = 0
+
+    def peek(self):
+        return self.tokens[self.pos] if self.pos < len(self.tokens) else None
+
+    def next(self):
+        token = self.peek()
+        if token is None:
+            raise SyntaxError('unexpected end of term')
+        self.pos += 1
+        return token
+
+    def term(self):
+        if self.peek() == '\\':
+            self.next()
+            names = []
+            while self.peek() != '.':
+                names.append(self.next())
+            self.next()
+            body = self.term()
+            for name in reversed(names):
+                body = ('lam', name, body)
+            return body
+        f = self.atom()
+        while self.peek() not in (None, ')'):
+            if self.peek() == '\\':
+                return ('app', f, self.term())
+            f = ('app', f, self.atom())
+        return f
+
+    def atom(self):
+        token = self.next()
+        if token == '(':
+            t = self.term()
+            if self.next() != ')':
+                raise SyntaxError('missing )')
+            return t
+        if token.startswith('#'):
+            return church(int(token[1:]))
+        if token.startswith('"'):
+            data = token[1:-1].encode().decode('unicode_escape').encode('latin-1')
+            t = ('lam', 'a', ('lam', 'b', ('var', 'b')))       # nil
+            for byte in reversed(data):
+                t = ('lam', 'f', ('app', ('app', ('var', 'f'), church(byte)), t))
+            return t
+        if not re.match(r'[A-Za-z_]', token):
+            raise SyntaxError('unexpected ' + token)
+        return ('var', token)
+
+
+def church(n):
+    body = ('var', 'x')
+    for _ in range(n):
+        body = ('app', ('var', 'f'), body)
+    return ('lam', 'f', ('lam', 'x', body))
+
+
+def expand(t, defs, env):
+    if t[0] == 'var':
+        if t[1] in env:
+            return t
+        if t[1] in defs:
+            return expand(defs[t[1]], defs, [])
+        raise NameError('unbound name ' + t[1])
+    if t[0] == 'lam':
+        return ('lam', t[1], expand(t[2], defs, env + [t[1]]))
+    return ('app', expand(t[1], defs, env), expand(t[2], defs, env))
+
+
+def encode(t, env, out):
+    """Appends the bits of t in the binary lambda calculus."""
+    stack = [(t, env)]
+    while stack:
+        t, env = stack.pop()
+        if t[0] == 'var':
+            out.append('1' * (env[::-1].index(t[1]) + 1) + '0')
+        elif t[0] == 'lam':
+            out.append('00')
+            stack.append((t[2], env + [t[1]]))
+        else:
+            out.append('01')
+            stack.append((t[2], env))
+            stack.append((t[1], env))
+
+
+def compile_source(text):
+    defs = {}
+    name, lines = None, []
+
+    def define():
+        if name:
+            defs[name] = Parser(' '.join(lines)).term()
+
+    for line in text.split('\n'):
+        line = line.split('--')[0].rstrip()
+        if not line.strip():
+            continue
+        m = re.match(r'([A-Za-z_][A-Za-z0-9_\']*)\s*=(.*)$', line)
+        if m and not line[0].isspace():
+            define()
+            name, lines = m.group(1), [m.group(2)]
+        else:
+            lines.append(line)
+    define()
+    if 'main' not in defs:
+        raise NameError('no main')
+    out = []
+    encode(expand(defs['main'], defs, []), [], out)
+    bits = ''.join(out)
+    bits += '0' * (-len(bits) % 8)
+    return bytes(int(bits[i:i + 8], 2) for i in range(0, len(bits), 8))
+
+
+def main():
+    text = '\n'.join(open(path).read() for path in sys.argv[1:])
+    sys.stdout.buffer.write(compile_source(text))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""Runs the benchmarks of clamb and compares them with a baseline.
+
+Usage: run.py [options] [clamb]
+
+Each benchmark is a program of this directory (compiled with lamc.py
+after prelude.lam) run on inputs of a few sizes. For every run the
+statistics of clamb -v1 are recorded: reductions, reductions per second
+of evaluation, evaluation and GC time, the largest old generation, the
+deepest stack, and the wall-clock time (the best of --repeat runs).
+
+The results are compared with baseline.json: a metric that grew by more
+than --threshold percent is a regression, and the run fails. The times
+in the baseline are those of the machine it was saved on, so save one of
+your own (--save) before comparing changes.
+"""
+import argparse
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import lamc
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# name, source, kind of input, sizes
+BENCHMARKS = [
+    ('cat', 'cat.lam', 'text', [1 << 20, 4 << 20]),
+    ('rot13', 'rot13.lam', 'text', [4 << 10, 16 << 10]),
+    ('rev', 'rev.lam', 'text', [10 << 10, 40 << 10]),
+    ('primes', 'primes.lam', 'number', [100, 200]),
+    ('selfint', 'selfint.lam', 'program', [400, 1600]),
+    ('translate', None, 'library', [200, 800]),
+]
+
+# metrics compared with the baseline; all of them are worse when larger.
+# The size of the heap follows the measured GC times, so the live cells
+# are compared instead.
+METRICS = ['wall_time', 'reductions', 'max_live', 'max_stack']
+TIME_FLOOR = 0.02       # seconds; smaller changes of wall_time are noise
+
+STATS = [
+    ('reductions', r'\n(-?\d+) reductions\n', int),
+    ('program_size', r'program size +--- (\d+) cells', int),
+    ('load_time', r'total load time --- +([\d.]+) sec', float),
+    ('eval_time', r'total eval time --- +([\d.]+) sec', float),
+    ('gc_time', r'total gc time +--- +([\d.]+) sec', float),
+    ('max_gc_pause', r'max gc pause +--- +([\d.]+) sec', float),
+    ('max_stack', r'max stack depth --- (\d+)', int),
+    ('max_heap', r'max heap size +--- (\d+) cells', int),
+    ('max_live', r'max heap size +--- \d+ cells, (\d+) live', int),
+]
+
+
+def text_input(size):
+    """Returns size bytes of lines of random words."""
+    rnd = random.Random(size)
+    words = [''.join(rnd.choice('abcdefghijklmnopqrstuvwxyzABCDEFGHIJ')
+                     for _ in range(rnd.randint(1, 9))) for _ in range(500)]
+    out, length = [], 0
+    while length < size:
+        line = ' '.join(rnd.choice(words) for _ in range(rnd.randint(3, 12)))
+        out.append(line + '\n')
+        length += len(line) + 1
+    return ''.join(out).encode()[:size]
+
+
+def library_program(num_terms, term_size=1000):
+    """Returns a program that binds num_terms random closed terms of
+    term_size nodes and uses none of them, so that running it costs the
+    translation alone."""
+    rnd = random.Random(num_terms)
+
+    def term(depth, size, out):
+        # iterative, since the terms are deep
+        stack = [(depth, size)]
+        while stack:
+            depth, size = stack.pop()
+            if size <= 1:
+                out.append('1' * (rnd.randrange(depth) + 1) + '0')
+            elif rnd.random() < 0.3 and depth < 40:
+                out.append('00')
+                stack.append((depth + 1, size - 1))
+            else:
+                k = rnd.randrange(1, size)
+                out.append('01')
+                stack.append((depth, size - k))
+                stack.append((depth, k))
+
+    out = ['01' * num_terms, '00' * num_terms, '0010']    # (\l... in. in) ...
+    for _ in range(num_terms):
+        out.append('00' * 5)
+        term(5, term_size, out)
+    bits = ''.join(out)
+    bits += '0' * (-len(bits) % 8)
+    return bytes(int(bits[i:i + 8], 2) for i in range(0, len(bits), 8))
+
+
+def make_input(kind, size, prelude):
+    if kind == 'text':
+        return text_input(size)
+    if kind == 'number':
+        return b'%d\n' % size
+    if kind == 'program':
+        # the program run by the self-interpreter
+        return lamc.compile_source(
+            prelude + '\nmain = \\in. #%d (append "Hello, world!\\n") nil\n' % size)
+    return b''
+
+
+def run(clamb, options, program, data, work):
+    with open(os.path.join(work, 'input'), 'wb') as f:
+        f.write(data)
+    with open(os.path.join(work, 'input'), 'rb') as f:
+        start = time.perf_counter()
+        proc = subprocess.run([clamb, '-v1'] + options + [program], stdin=f,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        wall = time.perf_counter() - start
+    if proc.returncode != 0:
+        raise RuntimeError(proc.stderr.decode(errors='replace').strip())
+    out = proc.stdout.decode('latin-1')
+    result = {'wall_time': wall}
+    for name, pattern, conv in STATS:
+        m = list(re.finditer(pattern, out))
+        if not m:
+            raise RuntimeError('no "%s" in the output of clamb -v1' % name)
+        result[name] = conv(m[-1].group(1))
+    cpu = result['eval_time'] + result['gc_time']
+    result['reductions_per_sec'] = result['reductions'] / cpu if cpu else 0
+    return result
+
+
+def run_all(args):
+    prelude = open(os.path.join(HERE, 'prelude.lam')).read()
+    results = {}
+    with tempfile.TemporaryDirectory() as work:
+        for name, source, kind, sizes in BENCHMARKS:
+            if args.only and name not in args.only:
+                continue
+            if source:
+                text = open(os.path.join(HERE, source)).read()
+                code = lamc.compile_source(prelude + '\n' + text)
+            program = os.path.join(work, name + '.ul')
+            for size in sizes:
+                data = make_input(kind, size, prelude)
+                if kind == 'library':
+                    code = library_program(size)
+                with open(program, 'wb') as f:
+                    f.write(code)
+                best = None
+                for _ in range(args.repeat):
+                    r = run(args.clamb, args.option, program, data, work)
+                    if best is None or r['wall_time'] < best['wall_time']:
+                        best = r
+                key = '%s/%d' % (name, size)
+                results[key] = best
+                print_result(key, best)
+                sys.stdout.flush()
+    return results
+
+
+def print_result(key, r):
+    print('%-16s %7.3fs %11d red. %6.1fM red/s  load %5.2fs  eval %5.2fs  '
+          'gc %5.2fs  heap %9d/%-9d stack %6d' %
+          (key, r['wall_time'], r['reductions'], r['reductions_per_sec'] / 1e6,
+           r['load_time'], r['eval_time'], r['gc_time'], r['max_live'],
+           r['max_heap'], r['max_stack']))
+
+
+def compare(results, baseline, threshold):
+    """Prints the changes beyond threshold, and returns the number of
+    regressions."""
+    regressions = 0
+    for key, r in results.items():
+        base = baseline.get(key)
+        if base is None:
+            print('%-16s not in the baseline' % key)
+            continue
+        for metric in METRICS:
+            old, new = base.get(metric), r[metric]
+            if not old:
+                continue
+            if metric == 'wall_time' and abs(new - old) < TIME_FLOOR:
+                continue
+            change = 100.0 * (new - old) / old
+            if change > threshold:
+                regressions += 1
+                verdict = 'REGRESSION'
+            elif change < -threshold:
+                verdict = 'improvement'
+            else:
+                continue
+            print('%-16s %-11s %+6.1f%%  %s -> %s  %s' %
+                  (key, metric, change, fmt(old), fmt(new), verdict))
+    return regressions
+
+
+def fmt(x):
+    return '%.3f' % x if isinstance(x, float) else str(x)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Runs the benchmarks of clamb and compares them with a '
+                    'baseline.')
+    parser.add_argument('clamb', nargs='?', default=os.path.join(HERE, '..', 'clamb'))
+    parser.add_argument('--baseline', default=os.path.join(HERE, 'baseline.json'))
+    parser.add_argument('--save', action='store_true',
+                        help='save the results as the baseline')
+    parser.add_argument('--threshold', type=float, default=15.0,
+                        help='percent of growth that counts as a regression')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs of each input, of which the fastest counts')
+    parser.add_argument('--only', action='append',
+                        help='run only this benchmark (may be repeated)')
+    parser.add_argument('-X', dest='option', action='append', default=[],
+                        metavar='NAME=VALUE', help='pass -X NAME=VALUE to clamb')
+    args = parser.parse_args()
+    args.option = [o for x in args.option for o in ('-X', x)]
+
+    results = run_all(args)
+    if args.save:
+        with open(args.baseline, 'w') as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('saved %s' % args.baseline)
+        return 0
+    if not os.path.exists(args.baseline):
+        print('no baseline at %s (save one with --save)' % args.baseline)
+        return 0
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    regressions = compare(results, baseline, args.threshold)
+    if regressions:
+        print('%d regressions beyond %g%%' % (regressions, args.threshold))
+        return 1
+    print('no regressions beyond %g%%' % args.threshold)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -7,23 +7,40 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "clamb.h"
 
 #define VERSION "0.1.0"
 
 #define INITIAL_HEAP_SIZE 128*1024
-#define RDSTACK_SIZE    100000
+#define NURSERY_SIZE    64*1024
+#define RDSTACK_SIZE    (16*1024*1024)   /* reserved, not committed */
 
 // Verbosity levels
 enum {
     V_NONE,
     V_STATS,
     V_GC,
-} verbosity = V_NONE;
+    V_PROFILE,
+};
 
 /**********************************************************************
  *  Storage management
@@ -36,102 +53,609 @@ enum {
  *  -------- -------- -------- ------10   Combinator
  *  -------- -------- -------- -----011   Character
  *  -------- -------- -------- -----111   Miscellaneous
+ *
+ *  A Cell is normally a pointer. When compiled with -DCOMPACT_CELLS, it
+ *  is a 32-bit word instead, where a pair is its index in a reserved
+ *  arena shifted over the tag. Pairs shrink to 8 bytes, and the heap can
+ *  still reach 2^30 cells (8 GB).
  */
 
+#ifdef COMPACT_CELLS
+typedef uint32_t Cell;
+typedef int32_t CellInt;
+#define CELLINT_MAX     INT32_MAX
+#else
 struct tagPair;
 typedef struct tagPair *Cell;
+typedef intptr_t CellInt;
+#define CELLINT_MAX     INTPTR_MAX
+#endif
 #define CELL(x) ((Cell)(x))
-#define TAG(c)  ((intptr_t)(c) & 0x03)
+#define TAG(c)  ((CellInt)(c) & 0x03)
 
 /* pair */
 typedef struct tagPair {
     Cell car;
     Cell cdr;
 } Pair;
+
+/* PTR and REF convert between pair Cells and Pair pointers, and
+ * CELL_AT(c, i) is the i-th pair of a block returned by alloc. */
+#ifdef COMPACT_CELLS
+#define PTR(c)          (vm->heap_base + ((c) >> 2))
+#define REF(p)          CELL(((p) - vm->heap_base) << 2)
+#define CELL_AT(c, i)   ((c) + ((Cell)(i) << 2))
+#else
+#define PTR(c)          (c)
+#define REF(p)          (p)
+#define CELL_AT(c, i)   ((c) + (i))
+#endif
+
 #define ispair(c)       (TAG(c) == 0)
-#define car(c)          ((c)->car)
-#define cdr(c)          ((c)->cdr)
-#define SET(c,fst,snd)  ((c)->car = (fst), (c)->cdr = (snd))
+#define car(c)          (PTR(c)->car)
+#define cdr(c)          (PTR(c)->cdr)
+#define SET(c,fst,snd)  (BARRIER(c), car(c) = (fst), cdr(c) = (snd))
+#define SETCAR(c,x)     (BARRIER(c), car(c) = (x))
+#define SETCDR(c,x)     (BARRIER(c), cdr(c) = (x))
 
 /* integer */
 #define isint(c)        (TAG(c) == 1)
-#define mkint(n)        CELL(((intptr_t)(n) << 2) + 1)
-#define intof(c)        ((intptr_t)(c) >> 2)
+#define mkint(n)        CELL(((CellInt)(n) << 2) + 1)
+#define intof(c)        ((CellInt)(c) >> 2)
 
 /* combinator */
 #define iscomb(c)       (TAG(c) == 2)
-#define mkcomb(n)       CELL(((n) << 2) + 2)
-#define combof(c)       ((intptr_t)(c) >> 2)
-#define COMB_S          mkcomb(0)
-#define COMB_K          mkcomb(1)
-#define COMB_I          mkcomb(2)
-#define COMB_B          mkcomb(3)
-#define COMB_C          mkcomb(4)
-#define COMB_SP         mkcomb(5)
-#define COMB_BS         mkcomb(6)
-#define COMB_CP         mkcomb(7)
-#define COMB_IOTA       mkcomb(8)
-#define COMB_KI         mkcomb(9)
-#define COMB_READ       mkcomb(10)
-#define COMB_WRITE      mkcomb(11)
-#define COMB_INC        mkcomb(12)
-#define COMB_CONS       mkcomb(13)
-#define COMB_PUTC       mkcomb(14)
-#define COMB_RETURN     mkcomb(15)
-
-/* character */
-#define ischar(c)       (((intptr_t)(c) & 0x07) == 0x03)
-#define mkchar(n)       CELL(((intptr_t)(n) << 3) + 0x03)
-#define charof(c)       ((intptr_t)(c) >> 3)
+#define mkcomb(n)       CELL(((CellInt)(n) << 2) + 2)
+#define combof(c)       ((CellInt)(c) >> 2)
+enum {
+    C_S, C_K, C_I, C_B, C_C, C_SP, C_BS, C_CP, C_IOTA, C_KI,
+    C_READ, C_WRITE, C_INC, C_CONS, C_PUTC, C_RETURN,
+    C_SUCC, C_SUCC2, C_PRED, C_ISZERO, C_ADD, C_SUB, C_MUL,
+    C_BN, C_CN, C_SN, C_LAZY, C_JIT,
+    NUM_COMBS
+};
+
+/* rules of the reducer besides the combinators, for CLAMB_PROFILE and
+ * CLAMB_TRACE */
+enum {
+    P_CHAR_ZERO = NUM_COMBS, P_CHAR_INC, P_CHAR_APPLY,
+    P_INC_RESULT, P_PUTC_RESULT,
+    P_LOADER,                   /* allocations outside the reducer */
+    NUM_PROFILE
+};
+#define COMB_S          mkcomb(C_S)
+#define COMB_K          mkcomb(C_K)
+#define COMB_I          mkcomb(C_I)
+#define COMB_B          mkcomb(C_B)
+#define COMB_C          mkcomb(C_C)
+#define COMB_SP         mkcomb(C_SP)
+#define COMB_BS         mkcomb(C_BS)
+#define COMB_CP         mkcomb(C_CP)
+#define COMB_IOTA       mkcomb(C_IOTA)
+#define COMB_KI         mkcomb(C_KI)
+#define COMB_READ       mkcomb(C_READ)
+#define COMB_WRITE      mkcomb(C_WRITE)
+#define COMB_INC        mkcomb(C_INC)
+#define COMB_CONS       mkcomb(C_CONS)
+#define COMB_PUTC       mkcomb(C_PUTC)
+#define COMB_RETURN     mkcomb(C_RETURN)
+#define COMB_SUCC       mkcomb(C_SUCC)
+#define COMB_SUCC2      mkcomb(C_SUCC2)
+#define COMB_PRED       mkcomb(C_PRED)
+#define COMB_ISZERO     mkcomb(C_ISZERO)
+#define COMB_ADD        mkcomb(C_ADD)
+#define COMB_SUB        mkcomb(C_SUB)
+#define COMB_MUL        mkcomb(C_MUL)
+#define COMB_BN         mkcomb(C_BN)
+#define COMB_CN         mkcomb(C_CN)
+#define COMB_SN         mkcomb(C_SN)
+#define COMB_LAZY       mkcomb(C_LAZY)
+#define COMB_JIT        mkcomb(C_JIT)
+
+/* character (also used for any Church numeral known at load time) */
+#define ischar(c)       (((CellInt)(c) & 0x07) == 0x03)
+#define mkchar(n)       CELL(((CellInt)(n) << 3) + 0x03)
+#define charof(c)       ((CellInt)(c) >> 3)
 
 /* immediate objects */
-#define isimm(c)        (((intptr_t)(c) & 0x07) == 0x07)
-#define mkimm(n)        CELL(((n) << 3) + 0x07)
+#define isimm(c)        (((CellInt)(c) & 0x07) == 0x07)
+#define mkimm(n)        CELL(((CellInt)(n) << 3) + 0x07)
 #define NIL             mkimm(0)
 #define COPIED          mkimm(1)
-#define UNUSED_MARKER   mkimm(2)
+#define FORWARDING      mkimm(2)
 #define LAMBDA          mkimm(3)
+#define FRAME_INC       mkimm(4)
+#define FRAME_PUTC      mkimm(5)
+
+/* loader frames */
+#define PARSE_LAMBDA    mkimm(6)
+#define PARSE_FUN       mkimm(7)
+#define PARSE_ARG       mkimm(8)
+#define TR_LAMBDA       mkimm(9)
+#define TR_FUN          mkimm(10)
+#define TR_ARG          mkimm(11)
+#define UA_FUN          mkimm(12)
+#define UA_ARG          mkimm(13)
+#define TR_NATIVE       mkimm(14)
+#define KI_LAMBDA       mkimm(15)
+#define KI_FUN          mkimm(16)
+#define KI_ARG          mkimm(17)
+#define KI_NATIVE       mkimm(18)
+#define SH_FUN          mkimm(19)
+#define SH_ARG          mkimm(20)
+/* Krivine machine frames */
+#define KM_UPDATE       mkimm(21)
+#define KM_INC          mkimm(22)
+#define KM_PUTC         mkimm(23)
+
+/* INTERPRETER STATE
+ *
+ *  Everything an interpreter mutates lives in a Clamb context, so that
+ *  one process can run many programs (see clamb.h). vm is the context
+ *  the current thread works on: the API functions set it on entry, and
+ *  GC worker threads set it to the context they serve.
+ */
+
+/* The stack is reserved as a single anonymous mapping. Pages are
+ * committed by the OS as the stack grows into them, so the cost of an
+ * evaluation is proportional to the depth it actually reaches. */
+typedef struct {
+    Cell *sp;
+    Cell *low;          /* high-water mark */
+    Cell *stack;
+} RdStack;
+
+
+/* see Input */
+#define INPUT_BUFSIZE   (64*1024)
+#define INPUT_CHUNK     256             /* bytes listed by one READ */
+
+typedef struct {
+    char **argv;                /* NULL: no files, then read_fn */
+    int fd;
+    unsigned char *ptr, *end;   /* unread part of the current buffer */
+    unsigned char *map;         /* mapped file, or NULL */
+    size_t map_size;
+    int eof;                    /* stdin has reached EOF */
+    int would_block;            /* read_fn returned CLAMB_WOULDBLOCK */
+    uint64_t bits;              /* unread bits for read_bit (low nbits) */
+    int nbits;
+    int nbytes;                 /* bytes loaded into bits */
+    uint64_t hash;              /* hash of the bytes consumed by bits */
+    size_t nhashed;
+    unsigned char *pushback;    /* bytes given back by input_unread */
+    unsigned char *saved_ptr, *saved_end;
+    ClambReadFn read_fn;        /* the input after the buffer of clamb_load */
+    void *read_arg;
+    unsigned char buf[INPUT_BUFSIZE];
+} InputStream;
+
+/* see PARALLEL COPYING */
+#define GC_CHUNK        1024            /* cells */
+#define GC_DEQUE_SIZE   1024            /* ranges, a power of 2 */
+
+typedef struct {
+    Pair *start, *end;
+} GcRange;
+
+typedef struct {
+    pthread_t thread;
+    Clamb *vm;
+    Pair *ptr, *end;            /* current chunk */
+    Pair *scan;                 /* its unscanned cells are [scan, ptr) */
+    long top, bottom;           /* of deque */
+    GcRange deque[GC_DEQUE_SIZE];
+    GcRange *overflow;          /* when the deque is full; not stealable */
+    int num_overflow, overflow_size;
+} GcWorker;
+
+#define GC_PAUSE_BUCKETS 128            /* see GENERATIONS */
+
+/* see Output */
+#define OUTPUT_BUFSIZE  (64*1024)       /* the largest flush-size */
+#define OUTPUT_QUEUE    (1024*1024)     /* bytes the writer thread holds */
+#define OUTPUT_POLL     4095            /* reductions between looks at the
+                                           clock for flush-delay */
+
+enum { FLUSH_AUTO, FLUSH_SIZE, FLUSH_LINE, FLUSH_BYTE };
+
+enum { ENGINE_GRAPH, ENGINE_KAM };     /* see KRIVINE MACHINE */
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* the queue has changed */
+    unsigned char queue[OUTPUT_QUEUE];  /* a ring */
+    size_t head, len;
+    int stop;
+    int error;                  /* errno of a failed write, or 0 */
+} OutputWriter;
+
+/* see template_make */
+typedef struct {
+    int refs;                   /* contexts sharing it */
+    int size;
+    int engine;                 /* that it was loaded for */
+    Cell root;
+    Pair cells[];
+} Template;
+
+#ifdef CLAMB_TRACE
+#define TRACE_BUFSIZE   (64 * 1024)     /* events */
+#define TRACE_HEAP      0xffffffff      /* a node outside the program */
+#define TRACE_DEPTH_MAX 0xffffff
+
+/* see REDUCTION TRACE */
+typedef struct {
+    uint32_t info;              /* rule << 24 | stack depth */
+    uint32_t node;              /* program cell, or TRACE_HEAP */
+} TraceEvent;
+
+typedef struct {
+    FILE *fp;
+    Pair *base;                 /* program cells of the current run */
+    uint32_t size;
+    int program_written;
+    int error;                  /* a write has failed */
+    int len;
+    TraceEvent buf[TRACE_BUFSIZE];
+} Trace;
+#endif
+
+/* see COMPILED TERMS */
+#define JIT_SAMPLES     4096            /* counters, a power of 2 */
+#define JIT_MAX_ARGS    8
+
+typedef struct {
+    int arity;
+    int steps;                  /* reductions it stands for */
+    int ncells, nupdates, nstack;
+    int num_ops;
+    Cell node;                  /* the term (a weak reference) */
+    Cell orig;                  /* a copy of it */
+    Cell ops[];                 /* car and cdr of each new cell; PUSHED(n),
+                                   car and cdr for each one set; then the
+                                   new stack, from the bottom */
+} JitCode;
+
+typedef struct {
+    Cell node;
+    int count;                  /* samples, or -1 if it cannot be compiled */
+} JitSample;
+
+struct Clamb {
+    /* heap (see GENERATIONS) */
+    Pair *heap_base;            /* start of the heap reservation */
+    void *arena_map;            /* the reservation as mapped */
+    size_t arena_map_size;
+    Pair *nursery, *nursery_end, *free_ptr;
+    Pair *old_area, *old_end, *old_ptr;
+    int heap_size, next_heap_size;  /* size of the old generation */
+    int max_heap_size;          /* before the last shrink (see heap_peak) */
+    int max_alive;              /* most cells left by a major collection */
+    Pair *semispace[2];
+    int semispace_size;
+    double last_major_end;      /* wall_clock */
+    int last_major_alive;
+    Cell *remembered;
+    int num_remembered, remembered_size;
+    Pair *image_map;            /* mapped image (see image_map_file) */
+    size_t image_map_size;
+    Pair *to_ptr;               /* allocation pointer of the current copy */
+    int minor_gc;               /* nonzero while a minor collection is running */
+
+    /* parallel copying */
+    GcWorker *gc_workers;
+    int gc_pool;                /* number of threads in the pool */
+    pthread_barrier_t gc_start_barrier, gc_end_barrier;
+    Pair *gc_limit;             /* end of the to-space */
+    int gc_idle;                /* number of threads out of work */
+    int gc_shutdown;            /* workers exit at the next start */
+    const char *gc_failure;     /* why the copy stopped, or NULL */
+
+    /* tuning parameters (-X) */
+    int copy_depth;
+    int dead_space_advice;
+    int heap_initial;
+    int heap_max;               /* 0: the size of a semispace */
+    int gc_target;              /* percent of time in major collections */
+    int gc_threads;
+    int quantum;                /* reductions per clamb_step */
+    int jit_threshold;          /* samples that compile a term; 0: never */
+    int flush_policy;
+    int flush_size;             /* bytes */
+    int flush_delay;            /* microseconds; 0: never */
+    int output_thread;
+    int engine;
+
+    /* options */
+    int verbosity;
+    int kiselyov_mode;
+    int share_mode;
+    int lazy_mode;
+    char *cache_file;
+    char *snapshot_file;
+    int snapshot_pending;       /* a snapshot is taken at the next I/O */
+    char *trace_file;
+    char *stats_file;           /* -M */
+#ifdef CLAMB_TRACE
+    Trace *trace;               /* opened by the first run */
+#endif
+
+    RdStack rd_stack;
+    Cell *eval_bottom;          /* of the suspended run, or NULL */
+    Cell kam_term, kam_env;     /* see KRIVINE MACHINE */
+    long long yield_at;         /* reductions at which eval returns */
+    long long check_at;         /* see eval_schedule */
+    InputStream input;
+    JitCode **jit_codes;        /* see COMPILED TERMS; NULL: a free slot */
+    int num_jit_codes;          /* slots used */
+    JitSample *jit_samples;
+    char *mask_stack;           /* see Kiselyov's bracket abstraction */
+    int mask_sp, mask_size;
+
+    /* statistics */
+    long long reductions;
+    int num_minor_gc, num_major_gc;
+    int lazy_translations;
+    int jit_compiled;           /* terms */
+    long long jit_reductions;   /* done by compiled terms */
+#ifdef CLAMB_PROFILE
+    struct {
+        long count, cells;
+    } profile[NUM_PROFILE];
+    int profile_rule;           /* the rule new cells are counted for */
+#endif
+    double total_gc_time;
+    double max_gc_pause;
+    int gc_pauses[GC_PAUSE_BUCKETS];    /* see GENERATIONS */
+    long allocated, promoted;   /* cells, by the minor collections */
+    long major_scanned, major_alive;    /* from-space and live cells */
+    double parse_time, translate_time;  /* of load_program */
+
+    /* library use */
+    Template *template;         /* the loaded program */
+    ClambWriteFn write_fn;      /* NULL: stdout */
+    void *write_arg;
+    unsigned char out_buf[OUTPUT_BUFSIZE];
+    int out_len;
+    int out_limit;              /* out_len at which output_byte flushes */
+    int out_line;               /* also at newlines */
+    int out_polled;             /* out_len at the last output_poll */
+    long long out_polled_at;    /* reductions then */
+    double out_seen;            /* when output_poll saw it grow */
+    OutputWriter *writer;       /* NULL: not started */
+    jmp_buf *error_jmp;         /* where errexit returns to, or NULL */
+    pthread_t error_thread;     /* the thread error_jmp belongs to */
+    char error[256];
+};
+
+__thread Clamb *vm;
+
+/* With -DCLAMB_PROFILE, the reducer counts the reductions of each rule
+ * and the cells they allocate, and -v3 prints them. Without it these
+ * expand to nothing. */
+#ifdef CLAMB_PROFILE
+#define PROFILE(r)      (vm->profile[r].count++, vm->profile_rule = (r))
+#define PROFILE_CELLS(n) (vm->profile[vm->profile_rule].cells += (n))
+#define PROFILE_RESET() \
+    (memset(vm->profile, 0, sizeof(vm->profile)), vm->profile_rule = P_LOADER)
+#else
+#define PROFILE(r)      ((void)0)
+#define PROFILE_CELLS(n) ((void)0)
+#define PROFILE_RESET() ((void)0)
+#endif
+
+/* With -DCLAMB_TRACE, TRACE records a reduction of rule r at node when
+ * -T is given (see REDUCTION TRACE). */
+#ifdef CLAMB_TRACE
+#define TRACE(r, node)  (vm->trace ? trace_event(r, node) : (void)0)
+#define TRACING         (vm->trace != NULL)
+#else
+#define TRACE(r, node)  ((void)0)
+#define TRACING         0
+#endif
+
+/* GENERATIONS
+ *
+ *  New cells are allocated in the nursery, a fixed-size area which is
+ *  emptied by every minor collection: cells still reachable from the
+ *  roots or from the remembered set are promoted to the old generation.
+ *  The old generation is a semispace that is only collected (by a major
+ *  collection) when it cannot absorb another full nursery.
+ *
+ *  Cells outside the nursery that are mutated by SET/SETCAR/SETCDR are
+ *  recorded in the remembered set, so that a minor collection does not
+ *  need to scan the old generation.
+ *
+ *  The heap is reserved once as a range of virtual memory holding the
+ *  nursery and the two semispaces, with transparent huge pages where
+ *  available. The OS commits pages as they are first touched, so growing
+ *  the old generation just moves old_end further into its semispace.
+ *  After a major collection the used part of the dead semispace is given
+ *  back according to -X madvise: "none" (the default; the pages stay
+ *  committed for the next collection), "free" (MADV_FREE; the OS may
+ *  reclaim them when it needs memory) or "dontneed" (dropped at once, to
+ *  be faulted in again on reuse).
+ *
+ *  The size of the old generation starts at -X heap-initial and never
+ *  exceeds -X heap-max. After each major collection the free space for
+ *  the next cycle is chosen so that major collections take about
+ *  -X gc-target percent of the time: a collection costs time in
+ *  proportion to the live cells, and the time until the next one grows
+ *  with the free space, so the free space of the last cycle is scaled by
+ *  how far its measured GC fraction was from the target.
+ *
+ *  Pauses are timed with the monotonic clock, so that the collections of
+ *  one context are not charged for the other threads of the process, and
+ *  counted in a histogram of GC_PAUSE_BUCKETS buckets, four per doubling
+ *  from 1 microsecond, from which the statistics estimate percentiles.
+ *  Each minor collection adds the cells used in the nursery to the
+ *  allocated cells, and the ones it promotes to the promoted cells.
+ */
+
+#define ARENA_SIZE      (1 << 30)       /* cells */
+#define PARALLEL_GC_MIN (256 * 1024)    /* cells */
 
-Pair *heap_area, *free_ptr;
-int heap_size, next_heap_size;
+enum { ADVISE_NONE, ADVISE_DONTNEED, ADVISE_FREE };
 
-double total_gc_time = 0.0;
+#ifdef COMPACT_CELLS
+#define is_young(c)     ((c) < NURSERY_SIZE * 4)   /* nursery comes first */
+#else
+#define is_young(c) \
+    ((uintptr_t)(c) - (uintptr_t)vm->nursery < NURSERY_SIZE * sizeof(Pair))
+#endif
+#define BARRIER(c)  (is_young(c) ? (void)0 : remember(c))
 
 void gc_run(Cell *save1, Cell *save2);
+void gc_minor(Cell *save1, Cell *save2);
+void gc_major(Cell *save1, Cell *save2);
 void rs_copy(void);
+void rs_slice(int i, int n, Cell **start, Cell **end);
 Cell copy_cell(Cell c);
+void gc_parallel(Cell *save1, Cell *save2);
+void jit_copy_roots(void);
+void jit_sweep(void);
+void jit_revert(void);
+void output_exit(void);
+double wall_clock(void);
+void kam_start(Cell root);
+int kam_eval(Cell *bottom);
+#ifdef CLAMB_TRACE
+void trace_pin(void);
+void trace_close(void);
+#endif
 
+/* Reports an error. Inside the API functions the message is kept for
+ * clamb_error and the call returns; otherwise the process exits. */
 void errexit(char *fmt, ...)
 {
     va_list arg;
+    size_t len;
+
     va_start(arg, fmt);
+    if (vm && vm->error_jmp && pthread_equal(vm->error_thread, pthread_self())) {
+        vsnprintf(vm->error, sizeof(vm->error), fmt, arg);
+        va_end(arg);
+        len = strlen(vm->error);
+        if (len > 0 && vm->error[len - 1] == '\n')
+            vm->error[len - 1] = '\0';
+        longjmp(*vm->error_jmp, 1);
+    }
+    if (vm && vm->write_fn == NULL)
+        output_exit();
     vfprintf(stderr, fmt, arg);
     va_end(arg);
 
+#ifdef CLAMB_TRACE
+    if (vm && vm->trace)
+        trace_close();          /* keep the events up to the error */
+#endif
     exit(1);
 }
 
+/* Gives back the memory of cells in a dead semispace. */
+void release_area(Pair *area, size_t cells)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (sizeof(Pair) * cells + page - 1) / page * page;
+
+    if (vm->dead_space_advice == ADVISE_NONE || len == 0)
+        return;
+#ifdef MADV_FREE
+    if (vm->dead_space_advice == ADVISE_FREE && madvise(area, len, MADV_FREE) == 0)
+        return;
+#endif
+    madvise(area, len, MADV_DONTNEED);
+}
+
 void storage_init(int size)
 {
-    heap_size = size;
-    heap_area = malloc(sizeof(Pair) * heap_size);
-    if (heap_area == NULL)
-        errexit("Cannot allocate heap storage (%d cells)\n", heap_size);
-    assert(((intptr_t)heap_area & 3) == 0 && (sizeof(Pair) & 3) == 0);
-    
-    free_ptr = heap_area;
-    heap_area += heap_size;
-    next_heap_size = heap_size * 3 / 2;
+    size_t align = 2 * 1024 * 1024, arena;
+    char *p = MAP_FAILED;
+
+    if (vm->heap_max > 0 && vm->heap_max < 2 * NURSERY_SIZE)
+        errexit("heap-max is too small (at least %d bytes)\n",
+                (int)(2 * NURSERY_SIZE * sizeof(Pair)));
+    arena = ARENA_SIZE;
+    if (vm->heap_max > 0 && vm->heap_max < (ARENA_SIZE - NURSERY_SIZE) / 2)
+        arena = NURSERY_SIZE + 2 * (size_t)vm->heap_max;
+
+    /* reserve address space only, aligned for huge pages; take less if
+     * the system refuses */
+    for (; arena >= 5 * NURSERY_SIZE; arena /= 2) {
+        p = mmap(NULL, sizeof(Pair) * arena + align, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED)
+            break;
+    }
+    if (p == MAP_FAILED)
+        errexit("Cannot allocate heap storage (%d cells)\n", 5 * NURSERY_SIZE);
+    vm->arena_map = p;
+    vm->arena_map_size = sizeof(Pair) * arena + align;
+    vm->heap_base = (Pair *)(p + (align - (uintptr_t)p % align) % align);
+#ifdef MADV_HUGEPAGE
+    madvise(vm->heap_base, sizeof(Pair) * arena, MADV_HUGEPAGE);
+#endif
+    assert(((intptr_t)vm->heap_base & 3) == 0 && (sizeof(Pair) & 3) == 0);
+
+    vm->nursery = vm->heap_base;
+    vm->free_ptr = vm->nursery;
+    vm->nursery_end = vm->nursery + NURSERY_SIZE;
+    vm->semispace_size = (arena - NURSERY_SIZE) / 2;
+    vm->semispace[0] = vm->nursery_end;
+    vm->semispace[1] = vm->semispace[0] + vm->semispace_size;
+
+    if (vm->heap_max == 0 || vm->heap_max > vm->semispace_size)
+        vm->heap_max = vm->semispace_size;
+    if (size < 2 * NURSERY_SIZE)
+        size = 2 * NURSERY_SIZE;
+    vm->heap_size = size < vm->heap_max ? size : vm->heap_max;
+    vm->old_area = vm->semispace[0];
+    vm->old_ptr = vm->old_area;
+    vm->old_end = vm->old_area + vm->heap_size;
+    vm->next_heap_size = vm->heap_size;
+    vm->last_major_end = wall_clock();
+}
+
+/* Returns the size of the old generation for the next cycle, given the
+ * number of cells that survived a major collection that took pause
+ * seconds at the end of a cycle of cycle seconds. */
+int next_heap_target(int alive, double pause, double cycle)
+{
+    int percent = vm->gc_target < 1 ? 1 : vm->gc_target > 99 ? 99 : vm->gc_target;
+    double target = percent / 100.0;
+    double free_space = vm->heap_size - vm->last_major_alive, mutator, size;
+
+    if (cycle > pause && pause > 0) {
+        /* mutator time that would make the pause the target fraction;
+         * go halfway there, as the pauses are short and noisy */
+        mutator = pause * (1 - target) / target;
+        size = free_space * (1 + mutator / (cycle - pause)) / 2;
+        if (size > free_space * 4)
+            size = free_space * 4;
+        if (size < free_space / 2)
+            size = free_space / 2;
+    } else {
+        size = free_space * 4;
+    }
+    size += alive;
+    if (size < alive + 2 * NURSERY_SIZE)
+        size = alive + 2 * NURSERY_SIZE;
+    if (size < vm->heap_initial)
+        size = vm->heap_initial;
+    return size > vm->heap_max ? vm->heap_max : (int)size;
 }
 
 Cell pair(Cell fst, Cell snd)
 {
     Cell c;
-    if (free_ptr >= heap_area)
+    if (vm->free_ptr >= vm->nursery_end)
         gc_run(&fst, &snd);
 
-    assert(free_ptr < heap_area);
-    c = free_ptr++;
+    assert(vm->free_ptr < vm->nursery_end);
+    PROFILE_CELLS(1);
+    c = REF(vm->free_ptr++);
     car(c) = fst;
     cdr(c) = snd;
     return c;
@@ -140,75 +664,239 @@ Cell pair(Cell fst, Cell snd)
 Cell alloc(int n)
 {
     Cell p;
-    if (free_ptr + n > heap_area)
+    assert(n <= NURSERY_SIZE);
+    if (vm->free_ptr + n > vm->nursery_end)
         gc_run(NULL, NULL);
 
-    assert(free_ptr + n <= heap_area);
-    p = free_ptr;
-    free_ptr += n;
+    assert(vm->free_ptr + n <= vm->nursery_end);
+    PROFILE_CELLS(n);
+    p = REF(vm->free_ptr);
+    vm->free_ptr += n;
     return p;
 }
 
+void remember(Cell c)
+{
+    if (vm->num_remembered == vm->remembered_size) {
+        vm->remembered_size = vm->remembered_size ? vm->remembered_size * 2 : 1024;
+        vm->remembered = realloc(vm->remembered,
+                                 sizeof(Cell) * vm->remembered_size);
+        if (vm->remembered == NULL)
+            errexit("Cannot allocate remembered set (%d entries)\n",
+                    vm->remembered_size);
+    }
+    vm->remembered[vm->num_remembered++] = c;
+}
 
-void gc_run(Cell *save1, Cell *save2)
+/* Returns the bucket of the pause histogram for a pause of t seconds:
+ * 0 below 1 microsecond, then i from 2^((i-1)/4) to 2^(i/4). */
+int gc_pause_bucket(double t)
 {
-    static Pair* free_area = NULL;
-    int num_alive;
-    Pair *scan;
-    clock_t start = clock();
+    static const double quarter[] = { 1.189207, 1.414214, 1.681793 };
+    double us = t * 1e6;
+    int i = 1, j;
+
+    if (us < 1.0)
+        return 0;
+    for (; us >= 2.0; us /= 2)
+        i += 4;
+    for (j = 0; j < 3 && us >= quarter[j]; j++)
+        i++;
+    return i < GC_PAUSE_BUCKETS ? i : GC_PAUSE_BUCKETS - 1;
+}
+
+/* Returns the upper bound in seconds of bucket i of the histogram. */
+double gc_pause_limit(int i)
+{
+    static const double quarter[] = { 1.0, 1.189207, 1.414214, 1.681793 };
+    double us = quarter[i % 4];
+
+    for (; i >= 4; i -= 4)
+        us *= 2;
+    return us * 1e-6;
+}
+
+/* Estimates the pause that a fraction q of the collections did not
+ * exceed, from the histogram: the upper bound of its bucket. */
+double gc_pause_quantile(const Clamb *ctx, double q)
+{
+    long total = 0, seen = 0;
+    int i;
 
-    if (free_area == NULL) {
-        free_area = malloc(sizeof(Pair) * next_heap_size);
-        if (free_area == NULL)
-            errexit("Cannot allocate heap storage (%d cells)\n",
-                    next_heap_size);
+    for (i = 0; i < GC_PAUSE_BUCKETS; i++)
+        total += ctx->gc_pauses[i];
+    if (total == 0)
+        return 0.0;
+    for (i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        seen += ctx->gc_pauses[i];
+        if (seen >= q * total)
+            break;
     }
+    return gc_pause_limit(i) < ctx->max_gc_pause ?
+        gc_pause_limit(i) : ctx->max_gc_pause;
+}
+
+void gc_pause_end(double start)
+{
+    double pause = wall_clock() - start;
+    vm->total_gc_time += pause;
+    if (pause > vm->max_gc_pause)
+        vm->max_gc_pause = pause;
+    vm->gc_pauses[gc_pause_bucket(pause)]++;
+}
+
+void gc_run(Cell *save1, Cell *save2)
+{
+    double start = wall_clock();
+
+    gc_minor(save1, save2);
+    if (vm->old_end - vm->old_ptr < NURSERY_SIZE)
+        gc_major(save1, save2);
+
+    gc_pause_end(start);
+}
+
+/* Collects both generations and returns the number of live cells. */
+int gc_full(Cell *save)
+{
+    double start = wall_clock();
+
+    gc_minor(save, NULL);
+    gc_major(save, NULL);
+
+    gc_pause_end(start);
+    return vm->old_ptr - vm->old_area;
+}
 
-    free_ptr = scan = free_area;
-    free_area = heap_area - heap_size;
-    heap_area = free_ptr + next_heap_size;
+/* Returns the largest size the old generation has had. It only shrinks
+ * in major collections, which record the size they leave. */
+int heap_peak(void)
+{
+    return vm->heap_size > vm->max_heap_size ? vm->heap_size : vm->max_heap_size;
+}
+
+void gc_minor(Cell *save1, Cell *save2)
+{
+    Pair *scan;
+    int i;
+
+    vm->minor_gc = 1;
+    vm->to_ptr = scan = vm->old_ptr;
 
     rs_copy();
+    jit_copy_roots();
     if (save1)
         *save1 = copy_cell(*save1);
     if (save2)
         *save2 = copy_cell(*save2);
 
-    while (scan < free_ptr) {
-        car(scan) = copy_cell(car(scan));
-        cdr(scan) = copy_cell(cdr(scan));
+    for (i = 0; i < vm->num_remembered; i++) {
+        Cell c = vm->remembered[i];
+        car(c) = copy_cell(car(c));
+        cdr(c) = copy_cell(cdr(c));
+    }
+    vm->num_remembered = 0;
+
+    while (scan < vm->to_ptr) {
+        scan->car = copy_cell(scan->car);
+        scan->cdr = copy_cell(scan->cdr);
         scan++;
     }
 
-    num_alive = free_ptr - (heap_area - next_heap_size);
-    if (verbosity >= V_GC)
-        fprintf(stderr, "GC: %d / %d\n", num_alive, heap_size);
+    if (vm->verbosity >= V_GC)
+        fprintf(stderr, "GC (minor): %d / %d\n",
+                (int)(vm->to_ptr - vm->old_ptr), (int)(vm->free_ptr - vm->nursery));
+
+    vm->allocated += vm->free_ptr - vm->nursery;
+    vm->promoted += vm->to_ptr - vm->old_ptr;
+    vm->old_ptr = vm->to_ptr;
+    vm->free_ptr = vm->nursery;
+    vm->minor_gc = 0;
+    vm->num_minor_gc++;
+}
+
+void gc_major(Cell *save1, Cell *save2)
+{
+    Pair *from = vm->old_area, *from_end = vm->old_ptr;
+    double start = wall_clock(), end;
+    int num_alive, size;
+    Pair *scan;
+
+    /* the to-space must hold everything in the from-space, and the
+     * parallel copy may leave part of a chunk per thread unused */
+    size = from_end - from + vm->gc_threads * GC_CHUNK;
+    if (size < vm->next_heap_size)
+        size = vm->next_heap_size;
+    if (size > vm->semispace_size)
+        size = vm->semispace_size;
+    vm->to_ptr = scan =
+        vm->old_area == vm->semispace[0] ? vm->semispace[1] : vm->semispace[0];
+    vm->old_area = vm->to_ptr;
+    vm->old_end = vm->old_area + size;
+
+    if (vm->gc_threads > 1 && from_end - from >= PARALLEL_GC_MIN && !TRACING) {
+        gc_parallel(save1, save2);
+    } else {
+#ifdef CLAMB_TRACE
+        if (vm->trace)
+            trace_pin();        /* keeps the program cells in front */
+#endif
+        rs_copy();
+        jit_copy_roots();
+        if (save1)
+            *save1 = copy_cell(*save1);
+        if (save2)
+            *save2 = copy_cell(*save2);
 
-    if (heap_size != next_heap_size || num_alive * 8 > next_heap_size) {
-        heap_size = next_heap_size;
-        if (num_alive * 8 > next_heap_size)
-            next_heap_size = num_alive * 8;
+        while (scan < vm->to_ptr) {
+            scan->car = copy_cell(scan->car);
+            scan->cdr = copy_cell(scan->cdr);
+            scan++;
+        }
+    }
+    vm->old_ptr = vm->to_ptr;
+    jit_sweep();
+    if (vm->jit_samples)        /* they count addresses of the from-space */
+        memset(vm->jit_samples, 0, sizeof(JitSample) * JIT_SAMPLES);
 
-        free(free_area);
-        free_area = NULL;
+    if (vm->image_map) {
+        /* every live cell of the mapped program has been copied */
+        munmap(vm->image_map, vm->image_map_size);
+        vm->image_map = NULL;
     }
 
-    total_gc_time += (clock() - start) / (double)CLOCKS_PER_SEC;
+    num_alive = vm->old_ptr - vm->old_area;
+    if (vm->heap_size > vm->max_heap_size)
+        vm->max_heap_size = vm->heap_size;
+    if (num_alive > vm->max_alive)
+        vm->max_alive = num_alive;
+    vm->heap_size = size;
+    if (vm->verbosity >= V_GC)
+        fprintf(stderr, "GC: %d / %d\n", num_alive, vm->heap_size);
 
-    if (free_ptr >= heap_area)
-        gc_run(save1, save2);
-}
+    release_area(from, from_end - from);
+    vm->major_scanned += from_end - from;
+    vm->major_alive += num_alive;
 
-Cell copy_cell(Cell c)
-{
-    Cell r;
+    end = wall_clock();
+    vm->next_heap_size = next_heap_target(num_alive, end - start,
+                                          end - vm->last_major_end);
+    vm->last_major_end = end;
+    vm->last_major_alive = num_alive;
+    vm->num_major_gc++;
 
-    if (!ispair(c))
-        return c;
-    if (car(c) == COPIED)
-        return cdr(c);
+    if (vm->old_end - vm->old_ptr < NURSERY_SIZE) {
+        if (vm->heap_size >= vm->heap_max)
+            errexit("heap exhausted (%d live cells, heap-max is %d cells)\n",
+                    num_alive, vm->heap_max);
+        gc_major(save1, save2);
+    }
+}
 
-    r = free_ptr++;
+/* Copies the uncopied pair c to the to-space. */
+Cell copy_one(Cell c)
+{
+    Cell r = REF(vm->to_ptr++);
     car(r) = car(c);
     if (car(c) == COMB_I) {
         Cell tmp = cdr(c);
@@ -223,462 +911,4819 @@ Cell copy_cell(Cell c)
     return r;
 }
 
-/**********************************************************************
- *  Reduction Machine
- **********************************************************************/
-
-typedef struct {
-    Cell *sp;
-    Cell stack[RDSTACK_SIZE];
-} RdStack;
-
-RdStack rd_stack;
+/* Besides c itself, up to copy_depth cells of its car chain are copied
+ * right after it, so that the application spines eval walks stay
+ * contiguous in the to-space. The rest of the graph is still copied in
+ * the breadth-first order of the scan (see -X copy-depth). */
 
-void rs_init(void)
+Cell copy_cell(Cell c)
 {
-    int i;
-    rd_stack.sp = rd_stack.stack + RDSTACK_SIZE;
+    Cell r, p;
+    int depth;
+
+    if (!ispair(c) || (vm->minor_gc && !is_young(c)))
+        return c;
+    if (car(c) == COPIED)
+        return cdr(c);
 
-    for (i = 0; i < RDSTACK_SIZE; i++)
-        rd_stack.stack[i] = UNUSED_MARKER;
+    r = p = copy_one(c);
+    for (depth = vm->copy_depth; depth > 0; depth--) {
+        c = car(p);
+        if (!ispair(c) || (vm->minor_gc && !is_young(c)) || car(c) == COPIED)
+            break;
+        p = copy_one(c);
+    }
+    return r;
 }
 
-void rs_copy(void)
+/* PARALLEL COPYING
+ *
+ *  With -X gc-threads=N, a major collection of at least PARALLEL_GC_MIN
+ *  cells is done by N threads: the collecting thread and a pool of N-1
+ *  workers started at the first such collection. Each thread copies the
+ *  roots in its slice of the stack into chunks of the to-space, which it
+ *  claims by advancing to_ptr atomically, and scans its current chunk in
+ *  Cheney order. Scanning it cannot do right away (the rest of a chunk
+ *  that filled up, or half of its queue when some thread is idle) goes as
+ *  a range of cells onto its Chase-Lev deque, where idle threads steal
+ *  it from.
+ *
+ *  A pair is claimed by swinging its car to FORWARDING with a CAS. The
+ *  winner copies it, stores the new address in the cdr and then sets the
+ *  car to COPIED; other threads wait for that. The unused ends of the
+ *  last chunks are filled with dead (NIL . NIL) cells, so the to-space
+ *  is still a contiguous array of pairs.
+ *
+ *  A thread that cannot go on (the to-space or its queue is full) sets
+ *  gc_failure instead of calling errexit, which would exit the process on
+ *  a worker, or leave the others behind at the barriers on the collecting
+ *  thread. From then on no thread copies or claims any more cells, so
+ *  all of them run out of work and reach gc_end_barrier, after which the
+ *  collecting thread reports the error.
+ */
+
+#define GC_LEND_MIN     64              /* cells */
+
+#define GC_FAILED       (__atomic_load_n(&vm->gc_failure, __ATOMIC_RELAXED) != NULL)
+
+void gc_fail(const char *why)
 {
-    Cell *c;
-    for (c = rd_stack.stack + RDSTACK_SIZE - 1; c >= rd_stack.sp; c--)
-        *c = copy_cell(*c);
+    const char *none = NULL;
+    __atomic_compare_exchange_n(&vm->gc_failure, &none, why, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 }
 
-int rs_max_depth(void)
+void gc_push(GcWorker *w, Pair *start, Pair *end)
 {
-    int i;
-    for (i = 0; i < RDSTACK_SIZE; i++) {
-        if (rd_stack.stack[i] != UNUSED_MARKER)
-            break;
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    GcRange *r;
+
+    if (b - t < GC_DEQUE_SIZE) {
+        r = &w->deque[b & (GC_DEQUE_SIZE - 1)];
+        __atomic_store_n(&r->start, start, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->end, end, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+        return;
     }
-    return RDSTACK_SIZE - i;
+    if (w->num_overflow == w->overflow_size) {
+        int size = w->overflow_size ? w->overflow_size * 2 : 64;
+        GcRange *overflow = realloc(w->overflow, sizeof(GcRange) * size);
+        if (overflow == NULL) {
+            gc_fail("Cannot allocate GC work queue");
+            return;
+        }
+        w->overflow = overflow;
+        w->overflow_size = size;
+    }
+    w->overflow[w->num_overflow].start = start;
+    w->overflow[w->num_overflow++].end = end;
 }
 
-void rs_push(Cell c)
+/* Pops the newest range of w's own work. */
+int gc_take(GcWorker *w, GcRange *out)
 {
-    if (rd_stack.sp <= rd_stack.stack)
-        errexit("runtime error: stack overflow\n");
-    *--rd_stack.sp = c;
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1, t;
+    int ok = 1;
+
+    if (w->num_overflow > 0) {
+        *out = w->overflow[--w->num_overflow];
+        return 1;
+    }
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *out = w->deque[b & (GC_DEQUE_SIZE - 1)];
+    if (t == b) {
+        /* the last one; a thief may be taking it too */
+        ok = __atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return ok;
 }
 
-#define TOP             (*rd_stack.sp)
-#define POP             (*rd_stack.sp++)
-#define PUSH(c)         rs_push(c)
-#define PUSHED(n)       (*(rd_stack.sp+(n)))
-#define DROP(n)         (rd_stack.sp += (n))
-#define ARG(n)          cdr(PUSHED(n))
-#define APPLICABLE(n)   (bottom - rd_stack.sp > (n))
+/* Takes the oldest range of w's work from another thread. */
+int gc_steal(GcWorker *w, GcRange *out)
+{
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE), b;
+    GcRange *r;
 
-/**********************************************************************
- *  Loader
- **********************************************************************/
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+    r = &w->deque[t & (GC_DEQUE_SIZE - 1)];
+    out->start = __atomic_load_n(&r->start, __ATOMIC_RELAXED);
+    out->end = __atomic_load_n(&r->end, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
 
-typedef struct {
-    char **argv;
-    FILE *fp;
-    int ch;
-    int bit;
-} InputStream;
-InputStream input;
+int gc_steal_any(GcWorker *self, GcRange *out)
+{
+    int i, n = self - vm->gc_workers;
 
-void input_init(char **argv)
+    for (i = 1; i < vm->gc_pool; i++) {
+        if (gc_steal(&vm->gc_workers[(n + i) % vm->gc_pool], out))
+            return 1;
+    }
+    return 0;
+}
+
+/* Claims a new chunk for w. Returns 0 if the copy has failed. */
+int gc_new_chunk(GcWorker *w)
 {
-    input.argv = argv;
-    if (*input.argv) {
-        input.fp = fopen(*input.argv, "r");
-        if (input.fp == NULL)
-            errexit("cannot open %s\n", *input.argv);
+    Pair *p;
+
+    if (w->scan < w->ptr)
+        gc_push(w, w->scan, w->ptr);
+    if (GC_FAILED)
+        return 0;
+    p = __atomic_fetch_add(&vm->to_ptr, GC_CHUNK * sizeof(Pair), __ATOMIC_RELAXED);
+    if (p >= vm->gc_limit) {
+        gc_fail("heap exhausted (to-space overflow in parallel GC)");
+        return 0;
     }
-    else
-        input.fp = stdin;
-    input.ch = 0;
-    input.bit = 0;
+    w->ptr = w->scan = p;
+    w->end = p + GC_CHUNK < vm->gc_limit ? p + GC_CHUNK : vm->gc_limit;
+    return 1;
 }
 
-int read_char(void)
+/* Claims the uncopied pair c and returns its car, or returns COPIED when
+ * it has been copied, whether by this thread or another. */
+Cell gc_claim(Cell c)
 {
-    int c;
-    while ((c = fgetc(input.fp)) == EOF) {
-        if (*input.argv == NULL)
-            break;      /* input.fp is stdin */
-        fclose(input.fp);
-        if (*++input.argv) {
-            input.fp = fopen(*input.argv, "r");
-            if (input.fp == NULL)
-                errexit("cannot open %s\n", *input.argv);
+    Cell a = __atomic_load_n(&car(c), __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        if (a == COPIED)
+            return a;
+        if (a == FORWARDING) {
+            sched_yield();
+            a = __atomic_load_n(&car(c), __ATOMIC_ACQUIRE);
+        } else if (__atomic_compare_exchange_n(&car(c), &a, FORWARDING, 0,
+                                               __ATOMIC_ACQUIRE,
+                                               __ATOMIC_ACQUIRE)) {
+            return a;
         }
-        else
-            input.fp = stdin;
     }
-    return c;
 }
 
-int read_bit(void)
+/* Copies the pair c claimed by gc_claim, whose car was a. If the copy
+ * has failed, c is given back uncopied and returned. */
+Cell gc_copy_one(GcWorker *w, Cell c, Cell a)
 {
-    if (!input.bit) {
-        input.ch = read_char();
-        if (input.ch == EOF)
-            errexit("unexpected EOF\n");
-        input.bit = 0x80;
+    Cell r, d = cdr(c), next;
+
+    if (w->ptr == w->end && !gc_new_chunk(w)) {
+        __atomic_store_n(&car(c), a, __ATOMIC_RELEASE);
+        return c;
+    }
+    r = REF(w->ptr++);
+    /* skip I-chains as copy_one does; a cdr read while another thread
+     * is forwarding the cell is discarded by checking its car again */
+    while (a == COMB_I && ispair(d) &&
+           __atomic_load_n(&car(d), __ATOMIC_ACQUIRE) == COMB_I) {
+        next = __atomic_load_n(&cdr(d), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&car(d), __ATOMIC_RELAXED) != COMB_I)
+            break;
+        d = next;
     }
-    int r = (input.ch & input.bit) ? 1 : 0;
-    input.bit >>= 1;
+    car(r) = a;
+    cdr(r) = d;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&cdr(c), r, __ATOMIC_RELAXED);
+    __atomic_store_n(&car(c), COPIED, __ATOMIC_RELEASE);
     return r;
 }
 
-Cell parse(void)
+/* Parallel copy_cell. */
+Cell gc_copy(GcWorker *w, Cell c)
 {
-    Cell c;
-    if (read_bit()) {           /* variable */
-        int i;
-        for (i = 0; read_bit(); i++)
-            ;
-        c = mkint(i);
-    }
-    else if (read_bit()) {      /* application */
-        PUSH(parse());
-        c = parse();
-        c = pair(TOP, c);
-        POP;
-    }
-    else                        /* lambda */
-        c = pair(LAMBDA, parse());
+    Cell r, p, a;
+    int depth;
 
-    return c;
-}
+    if (!ispair(c) || GC_FAILED)
+        return c;
+    if ((a = gc_claim(c)) == COPIED)
+        return cdr(c);
 
-#define IS_K1(x) (ispair(x) && car(x) == COMB_K)
-#define IS_B2(x) (ispair(x) && ispair(car(x)) && car(car(x)) == COMB_B)
+    r = p = gc_copy_one(w, c, a);
+    for (depth = vm->copy_depth; depth > 0; depth--) {
+        c = car(p);
+        if (!ispair(c) || GC_FAILED || (a = gc_claim(c)) == COPIED)
+            break;
+        p = gc_copy_one(w, c, a);
+    }
+    return r;
+}
 
-Cell unabstract(Cell t)
+void gc_scan(GcWorker *w, Pair *p, Pair *end)
 {
-    if (isint(t)) {
-        if (t == mkint(0))
-            return COMB_I;
-        else
-            return pair(COMB_K, mkint(intof(t)-1));
+    for (; p < end; p++) {
+        p->car = gc_copy(w, p->car);
+        p->cdr = gc_copy(w, p->cdr);
     }
-    else if (ispair(t)) {
-        Cell f, g;
-        PUSH(cdr(t));
-        PUSH(unabstract(car(t)));
-        g = PUSHED(1) = unabstract(PUSHED(1));
-        f = TOP;
-        if (IS_K1(f)) {
-            if (g == COMB_I) {
-                /* S (K x) I => x */
-                f = cdr(f);
-            }
-            else if (IS_K1(g)) {
-                /* S (K x) (K y) => K (x y) */
-                car(g) = cdr(f);        /* x y */
-                cdr(f) = g;             /* K (x y) */
-            }
-            else if (IS_B2(g)) {
-                /* S (K x) (B y z) => B* x y z */
-                car(f) = COMB_BS;       /* B* x */
-                car(car(g)) = f;        /* B* x y z */
-                f = g;
-            }
-            else {
-                /* S (K x) y => B x y */
-                car(f) = COMB_B;        /* B x */
-                f = pair(f, g);         /* B x y */
-            }
-        }
-        else if (IS_K1(g)) {
-            if (IS_B2(f)) {
-                /* S (B x y) (K z) => C' x y z */
-                car(car(f)) = COMB_CP;
-                car(g) = f;
-                f = g;
-            }
-            else {
-                /* S x (K y) => C x y */
-                f = cdr(g);
-                SET(g, COMB_C, TOP);    /* C x */
-                f = pair(g, f);         /* C x y */
+}
+
+/* Copies w's roots and everything reachable that is left to it. */
+void gc_work(GcWorker *w, Cell *roots, Cell *roots_end)
+{
+    GcRange r;
+    Pair *p;
+
+    for (; roots < roots_end; roots++)
+        *roots = gc_copy(w, *roots);
+
+    for (;;) {
+        while (w->scan < w->ptr) {
+            p = w->scan++;
+            p->car = gc_copy(w, p->car);
+            p->cdr = gc_copy(w, p->cdr);
+            if (w->ptr - w->scan >= GC_LEND_MIN &&
+                __atomic_load_n(&vm->gc_idle, __ATOMIC_RELAXED) > 0) {
+                /* lend the older half to an idle thread */
+                p = w->scan + (w->ptr - w->scan) / 2;
+                gc_push(w, w->scan, p);
+                w->scan = p;
             }
         }
-        else if (IS_B2(f)) {
-            /* S (B x y) z => S' x y z */
-            car(car(f)) = COMB_SP;      /* S' x y */
-            f = pair(f, g);             /* S' x y z */
+        if (gc_take(w, &r) || gc_steal_any(w, &r)) {
+            gc_scan(w, r.start, r.end);
+            continue;
         }
-        else {
-            /* S x y */
-            f = pair(COMB_S, f);
-            f = pair(f, PUSHED(1));
+
+        /* out of work: done when every thread is */
+        __atomic_add_fetch(&vm->gc_idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&vm->gc_idle, __ATOMIC_SEQ_CST) == vm->gc_pool)
+                return;
+            sched_yield();
+            __atomic_sub_fetch(&vm->gc_idle, 1, __ATOMIC_SEQ_CST);
+            if (gc_steal_any(w, &r))
+                break;
+            __atomic_add_fetch(&vm->gc_idle, 1, __ATOMIC_SEQ_CST);
         }
-        DROP(2);
-        return f;
+        gc_scan(w, r.start, r.end);
     }
-    else
-        return pair(COMB_K, t);
 }
 
-Cell translate(Cell t)
+void *gc_worker_main(void *arg)
 {
-    if (!ispair(t))
-        return t;
-    if (car(t) == LAMBDA)
-        return unabstract(translate(cdr(t)));
-    else {
-        Cell s;
-        PUSH(cdr(t));
-        PUSH(translate(car(t)));
-        s = translate(PUSHED(1));
-        s = pair(TOP, s);
-        DROP(2);
-        return s;
+    GcWorker *w = arg;
+    Cell *roots, *roots_end;
+
+    vm = w->vm;
+    for (;;) {
+        pthread_barrier_wait(&vm->gc_start_barrier);
+        if (vm->gc_shutdown)
+            return NULL;
+        rs_slice(w - vm->gc_workers, vm->gc_pool, &roots, &roots_end);
+        gc_work(w, roots, roots_end);
+        pthread_barrier_wait(&vm->gc_end_barrier);
+    }
+    return NULL;
+}
+
+/* Does the copying of a major collection from to_ptr up to old_end,
+ * and leaves to_ptr at the end of the copy. The first call starts a pool
+ * of gc_threads threads. */
+void gc_parallel(Cell *save1, Cell *save2)
+{
+    Cell *roots, *roots_end;
+    GcWorker *w;
+    Pair *p;
+    int i;
+
+    if (vm->gc_workers == NULL) {
+        vm->gc_workers = calloc(vm->gc_threads, sizeof(GcWorker));
+        if (vm->gc_workers == NULL)
+            errexit("Cannot allocate GC threads (%d)\n", vm->gc_threads);
+        vm->gc_pool = vm->gc_threads;
+        for (i = 0; i < vm->gc_pool; i++)
+            vm->gc_workers[i].vm = vm;
+        pthread_barrier_init(&vm->gc_start_barrier, NULL, vm->gc_pool);
+        pthread_barrier_init(&vm->gc_end_barrier, NULL, vm->gc_pool);
+        for (i = 1; i < vm->gc_pool; i++) {
+            if (pthread_create(&vm->gc_workers[i].thread, NULL, gc_worker_main,
+                               &vm->gc_workers[i]) != 0)
+                errexit("Cannot start GC threads (%d)\n", vm->gc_pool);
+        }
+    }
+    for (i = 0; i < vm->gc_pool; i++) {
+        w = &vm->gc_workers[i];
+        w->ptr = w->end = w->scan = NULL;
+        w->top = w->bottom = 0;
+    }
+    vm->gc_limit = vm->old_end;
+    vm->gc_idle = 0;
+    vm->gc_failure = NULL;
+
+    pthread_barrier_wait(&vm->gc_start_barrier);
+    w = &vm->gc_workers[0];
+    if (save1)
+        *save1 = gc_copy(w, *save1);
+    if (save2)
+        *save2 = gc_copy(w, *save2);
+    vm->kam_term = gc_copy(w, vm->kam_term);
+    vm->kam_env = gc_copy(w, vm->kam_env);
+    for (i = 0; i < vm->num_jit_codes; i++) {
+        JitCode *code = vm->jit_codes[i];
+        int j;
+        if (code == NULL)
+            continue;
+        code->orig = gc_copy(w, code->orig);
+        for (j = 0; j < code->num_ops; j++)
+            code->ops[j] = gc_copy(w, code->ops[j]);
+    }
+    rs_slice(0, vm->gc_pool, &roots, &roots_end);
+    gc_work(w, roots, roots_end);
+    pthread_barrier_wait(&vm->gc_end_barrier);
+
+    for (i = 0; i < vm->gc_pool; i++) {
+        w = &vm->gc_workers[i];
+        for (p = w->ptr; p < w->end; p++)
+            p->car = p->cdr = NIL;
+    }
+    if (vm->to_ptr > vm->gc_limit)
+        vm->to_ptr = vm->gc_limit;
+    if (vm->gc_failure)
+        errexit("%s\n", vm->gc_failure);
+}
+
+/**********************************************************************
+ *  Reduction Machine
+ **********************************************************************/
+
+#define STACK_TOP       (vm->rd_stack.stack + RDSTACK_SIZE)
+
+void rs_init(void)
+{
+    vm->rd_stack.stack = mmap(NULL, sizeof(Cell) * RDSTACK_SIZE,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->rd_stack.stack == MAP_FAILED)
+        errexit("Cannot allocate reduction stack (%d cells)\n", RDSTACK_SIZE);
+    vm->rd_stack.sp = vm->rd_stack.low = STACK_TOP;
+}
+
+void rs_copy(void)
+{
+    Cell *c;
+    for (c = STACK_TOP - 1; c >= vm->rd_stack.sp; c--)
+        *c = copy_cell(*c);
+    vm->kam_term = copy_cell(vm->kam_term);
+    vm->kam_env = copy_cell(vm->kam_env);
+}
+
+/* The cells compiled terms refer to (see COMPILED TERMS) are roots. */
+void jit_copy_roots(void)
+{
+    int i, j;
+
+    for (i = 0; i < vm->num_jit_codes; i++) {
+        JitCode *code = vm->jit_codes[i];
+        if (code == NULL)
+            continue;
+        code->orig = copy_cell(code->orig);
+        for (j = 0; j < code->num_ops; j++)
+            code->ops[j] = copy_cell(code->ops[j]);
+    }
+}
+
+/* After the copy of a major collection, drops the codes of the terms
+ * that are garbage. The terms are not young, so minor collections do not
+ * move them. */
+void jit_sweep(void)
+{
+    int i;
+
+    for (i = 0; i < vm->num_jit_codes; i++) {
+        JitCode *code = vm->jit_codes[i];
+        if (code == NULL)
+            continue;
+        if (car(code->node) == COPIED)
+            code->node = cdr(code->node);
+        else {
+            free(code);
+            vm->jit_codes[i] = NULL;
+        }
+    }
+    while (vm->num_jit_codes > 0 && vm->jit_codes[vm->num_jit_codes - 1] == NULL)
+        vm->num_jit_codes--;
+}
+
+/* Returns the i-th of n roughly equal parts of the stack. */
+void rs_slice(int i, int n, Cell **start, Cell **end)
+{
+    long depth = STACK_TOP - vm->rd_stack.sp;
+    *start = vm->rd_stack.sp + depth * i / n;
+    *end = vm->rd_stack.sp + depth * (i + 1) / n;
+}
+
+int rs_max_depth(void)
+{
+    return STACK_TOP - vm->rd_stack.low;
+}
+
+void rs_push(Cell c)
+{
+    if (vm->rd_stack.sp <= vm->rd_stack.stack)
+        errexit("runtime error: stack overflow\n");
+    *--vm->rd_stack.sp = c;
+    if (vm->rd_stack.sp < vm->rd_stack.low)
+        vm->rd_stack.low = vm->rd_stack.sp;
+}
+
+#define TOP             (*vm->rd_stack.sp)
+#define POP             (*vm->rd_stack.sp++)
+#define PUSH(c)         rs_push(c)
+#define PUSHED(n)       (*(vm->rd_stack.sp+(n)))
+#define DROP(n)         (vm->rd_stack.sp += (n))
+#define ARG(n)          cdr(PUSHED(n))
+#define APPLICABLE(n)   (bottom - vm->rd_stack.sp > (n))
+
+/**********************************************************************
+ *  Output
+ **********************************************************************/
+
+/* Output goes to stdout, or to the write function of a library context,
+ * through out_buf. It is flushed as flush says: once flush-size bytes are
+ * pending ("size"), also at each newline ("line"), or at each byte
+ * ("byte", which -u selects). "auto" is "line" when stdout is a terminal
+ * and "size" otherwise. Pending output is also flushed before eval waits
+ * for input, and when no more has come for flush-delay microseconds; eval
+ * looks at the clock for that every OUTPUT_POLL reductions.
+ *
+ * With output-thread=1, the output to stdout is written by a thread of
+ * its own. A flush only copies the bytes into its queue, so that eval
+ * waits for a slow reader only when OUTPUT_QUEUE bytes are pending. */
+
+double wall_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns the CPU time of the process, in seconds. */
+double cpu_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Sets out_limit and out_line for a run. */
+void output_init(void)
+{
+    int policy = vm->flush_policy;
+
+    if (policy == FLUSH_AUTO)
+        policy = vm->write_fn == NULL && isatty(STDOUT_FILENO) ?
+            FLUSH_LINE : FLUSH_SIZE;
+    vm->out_limit = vm->flush_size < 1 ? 1 :
+        vm->flush_size > OUTPUT_BUFSIZE ? OUTPUT_BUFSIZE : vm->flush_size;
+    if (policy == FLUSH_BYTE)
+        vm->out_limit = 1;
+    vm->out_line = policy == FLUSH_LINE;
+    vm->out_polled_at = vm->reductions;
+}
+
+void *output_writer_main(void *arg)
+{
+    OutputWriter *w = arg;
+    size_t n;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->len == 0 && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->len == 0)
+            break;
+        n = w->len < OUTPUT_QUEUE - w->head ? w->len : OUTPUT_QUEUE - w->head;
+        pthread_mutex_unlock(&w->lock);
+        /* only this thread reads [head, head + n) */
+        if ((fwrite(w->queue + w->head, 1, n, stdout) < n ||
+             fflush(stdout) == EOF) && !w->error)
+            w->error = errno ? errno : EIO;
+        pthread_mutex_lock(&w->lock);
+        w->head = (w->head + n) % OUTPUT_QUEUE;
+        w->len -= n;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+OutputWriter *output_start(void)
+{
+    OutputWriter *w = calloc(1, sizeof(OutputWriter));
+
+    if (w == NULL)
+        errexit("Cannot allocate the output queue\n");
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, output_writer_main, w) != 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+        errexit("Cannot start the output thread\n");
+    }
+    return vm->writer = w;
+}
+
+void output_stop(void)
+{
+    OutputWriter *w = vm->writer;
+
+    if (w == NULL)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    vm->writer = NULL;
+}
+
+/* Waits, holding w->lock, until at most pending bytes are left in the
+ * queue, and reports a failed write of the writer thread. */
+void output_wait(OutputWriter *w, size_t pending)
+{
+    int error;
+
+    while (w->len > pending && !w->error)
+        pthread_cond_wait(&w->cond, &w->lock);
+    error = w->error;
+    w->error = 0;
+    if (error) {
+        pthread_mutex_unlock(&w->lock);
+        errexit("write error: %s\n", strerror(error));
+    }
+}
+
+void output_enqueue(const unsigned char *buf, size_t n)
+{
+    OutputWriter *w = vm->writer ? vm->writer : output_start();
+    size_t tail, k;
+
+    pthread_mutex_lock(&w->lock);
+    while (n > 0) {
+        output_wait(w, OUTPUT_QUEUE - 1);
+        tail = (w->head + w->len) % OUTPUT_QUEUE;
+        if (tail < w->head)
+            k = w->head - tail;
+        else
+            k = OUTPUT_QUEUE - tail;
+        if (k > n)
+            k = n;
+        memcpy(w->queue + tail, buf, k);
+        w->len += k;
+        buf += k;
+        n -= k;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+void output_flush(void)
+{
+    int n = vm->out_len;
+
+    vm->out_len = vm->out_polled = 0;
+    if (n == 0)
+        return;
+    if (vm->write_fn) {
+        if (vm->write_fn(vm->write_arg, vm->out_buf, n) < 0)
+            errexit("write error\n");
+    }
+    else if (vm->output_thread)
+        output_enqueue(vm->out_buf, n);
+    else if (fwrite(vm->out_buf, 1, n, stdout) < (size_t)n || fflush(stdout) == EOF)
+        errexit("write error: %s\n", strerror(errno));
+}
+
+/* Flushes the output and waits until it has been written. */
+void output_sync(void)
+{
+    output_flush();
+    if (vm->writer) {
+        pthread_mutex_lock(&vm->writer->lock);
+        output_wait(vm->writer, 0);
+        pthread_mutex_unlock(&vm->writer->lock);
+    }
+}
+
+/* Writes what it can of the output as the command exits on an error. */
+void output_exit(void)
+{
+    OutputWriter *w = vm->writer;
+
+    if (w) {
+        pthread_mutex_lock(&w->lock);
+        while (w->len > 0 && !w->error)
+            pthread_cond_wait(&w->cond, &w->lock);
+        pthread_mutex_unlock(&w->lock);
+    }
+    fwrite(vm->out_buf, 1, vm->out_len, stdout);
+    vm->out_len = 0;
+}
+
+/* Flushes the output if it has stopped growing for flush_delay. */
+void output_poll(void)
+{
+    double now;
+
+    if (vm->out_len == 0)
+        return;
+    now = wall_clock();
+    if (vm->out_len != vm->out_polled) {
+        vm->out_polled = vm->out_len;
+        vm->out_seen = now;
+    }
+    else if (now - vm->out_seen >= vm->flush_delay * 1e-6)
+        output_flush();
+}
+
+#define output_byte(c) \
+    (vm->out_buf[vm->out_len++] = (c), \
+     vm->out_len >= vm->out_limit || ((c) == '\n' && vm->out_line) ? \
+     output_flush() : (void)0)
+
+/**********************************************************************
+ *  Input
+ **********************************************************************/
+
+/* The program and its input are read from the concatenation of the
+ * files in argv followed by stdin. Regular files are mapped into memory
+ * as a whole; pipes and terminals are read through a buffer with read(),
+ * which returns as soon as some input is available. A library context
+ * reads the buffer given to clamb_load and then its read function, after
+ * flushing the output.
+ *
+ * The bytes making up the program (those consumed through the bit reader)
+ * are hashed, so that the program cache can recognize the program. */
+
+#define HASH_INIT       UINT64_C(14695981039346656037)   /* FNV-1a */
+#define HASH_BYTE(h, b) ((h) = ((h) ^ (b)) * UINT64_C(1099511628211))
+
+void input_open(int fd)
+{
+    struct stat st;
+    off_t off;
+
+    vm->input.fd = fd;
+    vm->input.map = NULL;
+    vm->input.ptr = vm->input.end = vm->input.buf;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return;
+    if ((off = lseek(fd, 0, SEEK_CUR)) < 0 || off >= st.st_size)
+        return;
+
+    vm->input.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (vm->input.map == MAP_FAILED) {
+        vm->input.map = NULL;
+        return;
+    }
+    madvise(vm->input.map, st.st_size, MADV_SEQUENTIAL);
+    vm->input.map_size = st.st_size;
+    vm->input.ptr = vm->input.map + off;
+    vm->input.end = vm->input.map + st.st_size;
+}
+
+void input_open_next(void)
+{
+    int fd;
+    if (vm->input.argv == NULL) {
+        /* read_fn */
+        vm->input.fd = -1;
+        vm->input.map = NULL;
+        vm->input.ptr = vm->input.end = vm->input.buf;
+        return;
+    }
+    if (*vm->input.argv == NULL) {
+        input_open(0);
+        return;
+    }
+    fd = open(*vm->input.argv, O_RDONLY);
+    if (fd < 0)
+        errexit("cannot open %s\n", *vm->input.argv);
+    input_open(fd);
+}
+
+void input_init(char **argv)
+{
+    vm->input.argv = argv;
+    vm->input.eof = 0;
+    vm->input.would_block = 0;
+    vm->input.nbits = vm->input.nbytes = 0;
+    vm->input.hash = HASH_INIT;
+    vm->input.nhashed = 0;
+    vm->input.pushback = NULL;
+    input_open_next();
+}
+
+/* Releases what the input holds, for a context to be reused or freed. */
+void input_close(void)
+{
+    free(vm->input.pushback);
+    vm->input.pushback = NULL;
+    if (vm->input.map)
+        munmap(vm->input.map, vm->input.map_size);
+    vm->input.map = NULL;
+    if (vm->input.argv && vm->input.fd > 0)
+        close(vm->input.fd);
+}
+
+/* Refills the buffer, moving on to the next file when the current one
+ * is exhausted. Returns 0 at the end of stdin, and also when read_fn has
+ * no input yet, setting would_block. */
+int input_fill(void)
+{
+    if (vm->input.pushback) {
+        free(vm->input.pushback);
+        vm->input.pushback = NULL;
+        vm->input.ptr = vm->input.saved_ptr;
+        vm->input.end = vm->input.saved_end;
+    }
+    while (!vm->input.eof) {
+        if (vm->input.ptr < vm->input.end)
+            return 1;           /* a newly mapped file */
+        if (vm->input.argv == NULL) {
+            int n = 0;
+            if (vm->input.read_fn) {
+                output_flush();
+                n = vm->input.read_fn(vm->input.read_arg, vm->input.buf,
+                                      INPUT_BUFSIZE);
+            }
+            if (n > 0) {
+                vm->input.ptr = vm->input.buf;
+                vm->input.end = vm->input.buf + n;
+                return 1;
+            }
+            if (n == CLAMB_WOULDBLOCK) {
+                vm->input.would_block = 1;
+                return 0;
+            }
+            if (n < 0)
+                errexit("read error\n");
+        }
+        else if (vm->input.map == NULL) {
+            ssize_t n;
+            output_flush();
+            n = read(vm->input.fd, vm->input.buf, INPUT_BUFSIZE);
+            if (n > 0) {
+                vm->input.ptr = vm->input.buf;
+                vm->input.end = vm->input.buf + n;
+                return 1;
+            }
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                errexit("read error: %s\n", strerror(errno));
+            }
+        }
+        else {
+            munmap(vm->input.map, vm->input.map_size);
+            vm->input.map = NULL;
+        }
+
+        if (vm->input.argv == NULL || *vm->input.argv == NULL)
+            vm->input.eof = 1;      /* at the end of stdin or read_fn */
+        else {
+            close(vm->input.fd);
+            vm->input.argv++;
+            input_open_next();
+        }
+    }
+    return 0;
+}
+
+#define read_char() \
+    (vm->input.ptr < vm->input.end || input_fill() ? *vm->input.ptr++ : EOF)
+
+/* Reads up to n bytes into buf, hashing them as the bit reader would.
+ * Returns the number of bytes read, which is less than n only at EOF. */
+size_t input_read_hashed(unsigned char *buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n && (vm->input.ptr < vm->input.end || input_fill())) {
+        size_t len = vm->input.end - vm->input.ptr;
+        if (len > n - got)
+            len = n - got;
+        memcpy(buf + got, vm->input.ptr, len);
+        vm->input.ptr += len;
+        got += len;
+    }
+    for (n = 0; n < got; n++)
+        HASH_BYTE(vm->input.hash, buf[n]);
+    vm->input.nhashed += got;
+    return got;
+}
+
+/* Makes buf (allocated by malloc, n bytes) the next input, and forgets the
+ * hash of consumed bytes. */
+void input_unread(unsigned char *buf, size_t n)
+{
+    assert(vm->input.nbits == 0);
+    if (vm->input.pushback) {
+        /* the rest of the previous pushback follows buf */
+        size_t rest = vm->input.end - vm->input.ptr;
+        buf = realloc(buf, n + rest);
+        if (buf == NULL)
+            errexit("Cannot allocate %lu bytes\n", (unsigned long)(n + rest));
+        memcpy(buf + n, vm->input.ptr, rest);
+        n += rest;
+        free(vm->input.pushback);
+    }
+    else {
+        vm->input.saved_ptr = vm->input.ptr;
+        vm->input.saved_end = vm->input.end;
+    }
+    vm->input.pushback = buf;
+    vm->input.ptr = buf;
+    vm->input.end = buf + n;
+    vm->input.hash = HASH_INIT;
+    vm->input.nhashed = 0;
+}
+
+/* Adds the first n bytes of the current input.bits to the hash. */
+void input_hash_bits(int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        HASH_BYTE(vm->input.hash,
+                  (vm->input.bits >> (vm->input.nbytes - 1 - i) * 8) & 0xff);
+    vm->input.nhashed += n;
+}
+
+/* Loads up to 8 bytes of the current buffer into input.bits. */
+void input_fill_bits(void)
+{
+    int i, n;
+    input_hash_bits(vm->input.nbytes);      /* the previous bytes are used up */
+    if (vm->input.ptr == vm->input.end && !input_fill())
+        errexit("unexpected EOF\n");
+    n = vm->input.end - vm->input.ptr < 8 ? vm->input.end - vm->input.ptr : 8;
+    vm->input.bits = 0;
+    for (i = 0; i < n; i++)
+        vm->input.bits = vm->input.bits << 8 | *vm->input.ptr++;
+    vm->input.nbits = n * 8;
+    vm->input.nbytes = n;
+}
+
+int read_bit(void)
+{
+    if (!vm->input.nbits)
+        input_fill_bits();
+    vm->input.nbits--;
+    return (vm->input.bits >> vm->input.nbits) & 1;
+}
+
+/* Reads 1 bits up to and including the next 0, and returns their count. */
+int read_ones(void)
+{
+    int n = 0;
+    for (;;) {
+        int run;
+        if (!vm->input.nbits)
+            input_fill_bits();
+#ifdef __GNUC__
+        {
+            uint64_t w = ~(vm->input.bits << (64 - vm->input.nbits));
+            run = w ? __builtin_clzll(w) : 64;
+        }
+#else
+        for (run = 0; run < vm->input.nbits &&
+                 (vm->input.bits >> (vm->input.nbits - run - 1)) & 1; run++)
+            ;
+#endif
+        if (run < vm->input.nbits) {
+            vm->input.nbits -= run + 1;
+            return n + run;
+        }
+        n += vm->input.nbits;
+        vm->input.nbits = 0;
+    }
+}
+
+/* Discards the rest of the current byte; the bytes that input.bits
+ * holds beyond it are given back to the buffer. */
+void input_align(void)
+{
+    input_hash_bits(vm->input.nbytes - vm->input.nbits / 8);
+    vm->input.ptr -= vm->input.nbits / 8;
+    vm->input.nbits = vm->input.nbytes = 0;
+}
+
+/**********************************************************************
+ *  Loader
+ **********************************************************************/
+
+/* The loader works on rd_stack instead of the C stack. Each pending
+ * term is represented by a frame marker (and the cell it needs later),
+ * so the loader's depth is bounded only by the reduction stack. */
+
+/* LAZY TRANSLATION
+ *
+ *  With -L, every closed lambda of at least LAZY_MIN nodes (not counting
+ *  the closed lambdas inside it) is left untranslated by the loader, as
+ *  the thunk LAZY t where t is the parsed term. Being closed, the thunk
+ *  is a constant for the bracket abstraction of its context. The reducer
+ *  translates t when it first reaches the thunk, and overwrites the thunk
+ *  with an indirection to the result, so each part of the program is
+ *  translated at most once and the parts that are never used not at all.
+ */
+#define LAZY_MIN        256
+
+#define islazy(c)       (ispair(c) && car(c) == COMB_LAZY)
+
+Cell native_term(Cell t);
+
+Cell parse(void)
+{
+    Cell *bottom = vm->rd_stack.sp;
+    Cell c;
+    int n, fv, size;    /* variables free in c (max index + 1), nodes */
+
+    for (;;) {
+        while (!read_bit()) {
+            if (read_bit())     /* application */
+                PUSH(PARSE_FUN);
+            else                /* lambda */
+                PUSH(PARSE_LAMBDA);
+        }
+        n = read_ones();                /* variable */
+        c = mkint(n);
+        fv = n + 1;
+        size = 1;
+
+        for (;;) {
+            if (vm->rd_stack.sp == bottom)
+                return c;
+            if (TOP == PARSE_LAMBDA) {
+                POP;
+                c = pair(LAMBDA, c);
+                if (fv > 0)
+                    fv--;
+                if (++size >= LAZY_MIN && fv == 0 && vm->lazy_mode &&
+                    vm->engine == ENGINE_GRAPH && native_term(c) == NIL) {
+                    c = pair(COMB_LAZY, c);
+                    size = 1;
+                }
+            }
+            else if (TOP == PARSE_FUN) {
+                TOP = c;
+                if (vm->lazy_mode) {
+                    PUSH(mkint(fv));
+                    PUSH(mkint(size));
+                }
+                PUSH(PARSE_ARG);
+                break;
+            }
+            else {              /* PARSE_ARG */
+                POP;
+                if (vm->lazy_mode) {
+                    size += intof(POP) + 1;
+                    n = intof(POP);
+                    if (fv < n)
+                        fv = n;
+                }
+                c = pair(TOP, c);
+                POP;
+            }
+        }
+    }
+}
+
+#define IS_K1(x) (ispair(x) && car(x) == COMB_K)
+#define IS_B2(x) (ispair(x) && ispair(car(x)) && car(car(x)) == COMB_B)
+
+/* Leaf case of the bracket abstraction [x]t. */
+Cell unabstract_leaf(Cell t)
+{
+    if (isint(t)) {
+        if (t == mkint(0))
+            return COMB_I;
+        else
+            return pair(COMB_K, mkint(intof(t)-1));
+    }
+    else
+        return pair(COMB_K, t);
+}
+
+/* Combines f = [x]a and g = [x]b into [x](a b). */
+Cell unabstract_app(Cell f, Cell g)
+{
+    PUSH(g);
+    PUSH(f);
+    if (IS_K1(f)) {
+        if (g == COMB_I) {
+            /* S (K x) I => x */
+            f = cdr(f);
+        }
+        else if (IS_K1(g)) {
+            /* S (K x) (K y) => K (x y) */
+            SETCAR(g, cdr(f));      /* x y */
+            SETCDR(f, g);           /* K (x y) */
+        }
+        else if (IS_B2(g)) {
+            /* S (K x) (B y z) => B* x y z */
+            SETCAR(f, COMB_BS);     /* B* x */
+            SETCAR(car(g), f);      /* B* x y z */
+            f = g;
+        }
+        else {
+            /* S (K x) y => B x y */
+            SETCAR(f, COMB_B);      /* B x */
+            f = pair(f, g);         /* B x y */
+        }
+    }
+    else if (IS_K1(g)) {
+        if (IS_B2(f)) {
+            /* S (B x y) (K z) => C' x y z */
+            SETCAR(car(f), COMB_CP);
+            SETCAR(g, f);
+            f = g;
+        }
+        else {
+            /* S x (K y) => C x y */
+            f = cdr(g);
+            SET(g, COMB_C, TOP);    /* C x */
+            f = pair(g, f);         /* C x y */
+        }
+    }
+    else if (IS_B2(f)) {
+        /* S (B x y) z => S' x y z */
+        SETCAR(car(f), COMB_SP);    /* S' x y */
+        f = pair(f, g);             /* S' x y z */
+    }
+    else {
+        /* S x y */
+        f = pair(COMB_S, f);
+        f = pair(f, PUSHED(1));
+    }
+    DROP(2);
+    return f;
+}
+
+/* NATIVE NUMERALS
+ *
+ *  Church numerals in the program are translated into CHAR immediates,
+ *  which the reducer expands into f (f ... z) only when they are applied.
+ *  The canonical arithmetic terms below are translated into OP g, where
+ *  g is their ordinary translation: OP computes its result directly when
+ *  its operands are already immediates, and otherwise reduces to g.
+ */
+
+static const struct {
+    const char *bits;
+    int op;
+} native_ops[] = {
+    { "000000011100101111011010", C_SUCC },   /* \n f x. f (n f x) */
+    { "000000010111101100111010", C_SUCC2 },  /* \n f x. n f (f x) */
+    { "0000000101011110000001100111011110001100010", C_PRED },
+                            /* \n f x. n (\g h. h (g f)) (\u. x) (\u. u) */
+    { "00010110000000100000110", C_ISZERO },  /* \n. n (\x a b. b) (\a b. a) */
+    { "000000000101111101100101111011010", C_ADD },
+                                            /* \m n f x. m f (n f x) */
+    { "00000101100000000101011110000001100111011110001100010110", C_SUB },
+                                            /* \m n. n PRED m */
+    { "0000000111100111010", C_MUL },        /* \m n f. m (n f) */
+};
+
+/* Matches t against a term in the binary encoding. Returns the rest of
+ * the pattern, or NULL. The recursion is bounded by the pattern. */
+const char *match_term(Cell t, const char *pat)
+{
+    if (islazy(t))
+        t = cdr(t);
+    if (pat[0] == '1') {
+        int i;
+        for (i = 0; *++pat == '1'; i++)
+            ;
+        return t == mkint(i) ? pat + 1 : NULL;
+    }
+    if (!ispair(t) || (pat[1] == '1') == (car(t) == LAMBDA))
+        return NULL;
+    if (pat[1] == '0')
+        return match_term(cdr(t), pat + 2);
+    pat = match_term(car(t), pat + 2);
+    return pat ? match_term(cdr(t), pat) : NULL;
+}
+
+/* Returns the immediate for a Church numeral \f x. f (... (f x)), the
+ * combinator for one of native_ops, or NIL. */
+Cell native_term(Cell t)
+{
+    Cell b = cdr(t);
+    int i, n;
+
+    if (ispair(b) && car(b) == LAMBDA) {
+        for (b = cdr(b), n = 0; ispair(b) && car(b) == mkint(1); n++)
+            b = cdr(b);
+        if (b == mkint(0))
+            return mkchar(n);
+    }
+    for (i = 0; i < sizeof(native_ops) / sizeof(native_ops[0]); i++) {
+        const char *rest = match_term(t, native_ops[i].bits);
+        if (rest && *rest == '\0')
+            return mkcomb(native_ops[i].op);
+    }
+    return NIL;
+}
+
+/* Translates a parsed term into combinators. translate and unabstract
+ * are interleaved on one frame stack: r is the result of the innermost
+ * completed subterm, and the frame on top says what to do with it. */
+Cell translate(Cell t)
+{
+    Cell *bottom = vm->rd_stack.sp;
+    Cell r;
+
+  translate:
+    while (ispair(t) && !islazy(t)) {
+        if (car(t) == LAMBDA) {
+            Cell n = native_term(t);
+            if (ischar(n)) {
+                t = n;
+                break;
+            }
+            if (n != NIL) {
+                PUSH(n);
+                PUSH(TR_NATIVE);
+            }
+            PUSH(TR_LAMBDA);
+            t = cdr(t);
+        }
+        else {
+            PUSH(cdr(t));
+            PUSH(TR_FUN);
+            t = car(t);
+        }
+    }
+    r = t;
+    goto complete;
+
+  unabstract:
+    while (ispair(t) && !islazy(t)) {
+        PUSH(cdr(t));
+        PUSH(UA_FUN);
+        t = car(t);
+    }
+    r = unabstract_leaf(t);
+
+  complete:
+    while (vm->rd_stack.sp != bottom) {
+        Cell frame = POP;
+        if (frame == TR_LAMBDA) {
+            t = r;
+            goto unabstract;
+        }
+        else if (frame == TR_FUN || frame == UA_FUN) {
+            t = TOP;
+            TOP = r;
+            PUSH(frame == TR_FUN ? TR_ARG : UA_ARG);
+            if (frame == TR_FUN)
+                goto translate;
+            else
+                goto unabstract;
+        }
+        else if (frame == TR_ARG || frame == TR_NATIVE)
+            r = pair(POP, r);
+        else    /* UA_ARG */
+            r = unabstract_app(POP, r);
+    }
+    return r;
+}
+
+/* KISELYOV'S ALGORITHM
+ *
+ *  An alternative to translate (selected by -k) after Kiselyov, "Lambda
+ *  to SKI, Semantically" (2018). A term is compiled to a pair (mask, d)
+ *  where mask tells which de Bruijn variables the term uses, and d
+ *  applied to the values of the used variables (outermost first) is the
+ *  term. Applications are combined with the bulk combinators
+ *
+ *      B_n f g x1..xn = f (g x1..xn)
+ *      C_n f g x1..xn = f x1..xn g
+ *      S_n f g x1..xn = f x1..xn (g x1..xn)
+ *
+ *  one per run of variables used by the same side, so the output size
+ *  is proportional to the de Bruijn term instead of growing with every
+ *  enclosing lambda. B_n is written BN NUM(n) in the graph, and B_1 is
+ *  plain B (likewise for C and S).
+ *
+ *  Masks follow the traversal in LIFO order, so they live on their own
+ *  byte stack (outermost variable first); the rd_stack frames only keep
+ *  their lengths.
+ */
+
+void mask_reserve(int n)
+{
+    if (vm->mask_sp + n <= vm->mask_size)
+        return;
+    while (vm->mask_sp + n > vm->mask_size)
+        vm->mask_size = vm->mask_size ? vm->mask_size * 2 : 1024;
+    vm->mask_stack = realloc(vm->mask_stack, vm->mask_size);
+    if (vm->mask_stack == NULL)
+        errexit("Cannot allocate variable masks (%d bytes)\n", vm->mask_size);
+}
+
+Cell bulk(Cell comb, int n)
+{
+    if (n == 1)
+        return comb;
+    if (n >= NURSERY_SIZE / 2)
+        errexit("lambda nesting too deep (%d)\n", n);
+    return pair(comb == COMB_B ? COMB_BN : comb == COMB_C ? COMB_CN : COMB_SN,
+                mkint(n));
+}
+
+/* Combines (mask1, d1) and (mask2, d2), whose masks of length n1 and n2
+ * are the top two on the mask stack, into the pair for their application.
+ * The masks are replaced by the result mask; its length is returned
+ * through *n and the number of used variables through *used. */
+Cell kiselyov_app(int n1, Cell d1, int n2, Cell d2, int *n, int *used)
+{
+    char *m1, *m2, *m, *letters;
+    int base = vm->mask_sp - n1 - n2;
+    int i, k, len;
+    Cell f;
+
+    len = n1 > n2 ? n1 : n2;
+    mask_reserve(2 * len);
+    m1 = vm->mask_stack + base - (len - n1);        /* aligned on variable 0 */
+    m2 = vm->mask_stack + base + n1 - (len - n2);
+    m = vm->mask_stack + vm->mask_sp;
+    letters = m + len;
+    for (i = k = 0; i < len; i++) {
+        int b1 = i >= len - n1 && m1[i];
+        int b2 = i >= len - n2 && m2[i];
+        m[i] = b1 || b2;
+        if (m[i])
+            letters[k++] = b1 && b2 ? 'S' : b1 ? 'C' : 'B';
+    }
+    memmove(vm->mask_stack + base, m, len);
+    vm->mask_sp = base + len;
+    *n = len;
+    *used = k;
+
+    if (k == 0)
+        return pair(d1, d2);
+    if (d2 == COMB_I && n2 == 1 && letters[k - 1] == 'B')
+        return d1;                              /* \x. d1 x  ==>  d1 */
+
+    /* With runs X_1..X_r of the letters (outermost first), the combinator
+     * is P_1 where P_r = X_r and P_j = B X_j (B_p P_(j+1)), p being the
+     * number of variables of X_j passed to f. P_1 d1 d2 is emitted as
+     * X_1 (B_p P_2 d1) d2. */
+    PUSH(d2);
+    PUSH(d1);
+    PUSH(NIL);
+    for (i = k; i > 0; ) {
+        char c = letters[i - 1];
+        int run = 0;
+        Cell x;
+        while (i > 0 && letters[i - 1] == c) {
+            i--;
+            run++;
+        }
+        x = bulk(c == 'S' ? COMB_S : c == 'C' ? COMB_C : COMB_B, run);
+        if (TOP == NIL) {
+            TOP = x;
+            continue;
+        }
+        PUSH(x);
+        if (c != 'B') {
+            f = bulk(COMB_B, run);
+            PUSHED(1) = pair(f, PUSHED(1));
+        }
+        if (i == 0) {
+            f = pair(PUSHED(1), PUSHED(2));
+            f = pair(TOP, f);
+            f = pair(f, PUSHED(3));
+            DROP(4);
+            return f;
+        }
+        f = pair(COMB_B, TOP);
+        PUSHED(1) = pair(f, PUSHED(1));
+        DROP(1);
+    }
+    f = pair(TOP, PUSHED(1));
+    f = pair(f, PUSHED(2));
+    DROP(3);
+    return f;
+}
+
+Cell kiselyov(Cell t)
+{
+    Cell *bottom = vm->rd_stack.sp;
+    Cell d;
+    int n, used;
+
+  descend:
+    while (ispair(t) && !islazy(t)) {
+        if (car(t) == LAMBDA) {
+            Cell op = native_term(t);
+            if (ischar(op)) {
+                t = op;
+                break;
+            }
+            if (op != NIL) {
+                PUSH(op);
+                PUSH(KI_NATIVE);
+            }
+            PUSH(KI_LAMBDA);
+            t = cdr(t);
+        }
+        else {
+            PUSH(cdr(t));
+            PUSH(KI_FUN);
+            t = car(t);
+        }
+    }
+    if (isint(t)) {
+        n = intof(t) + 1;
+        mask_reserve(n);
+        memset(vm->mask_stack + vm->mask_sp, 0, n);
+        vm->mask_stack[vm->mask_sp] = 1;
+        vm->mask_sp += n;
+        d = COMB_I;
+        used = 1;
+    }
+    else {
+        d = t;
+        n = used = 0;
+    }
+
+    while (vm->rd_stack.sp != bottom) {
+        Cell frame = POP;
+        if (frame == KI_LAMBDA) {
+            if (n == 0)
+                d = pair(COMB_K, d);
+            else {
+                n--;
+                if (vm->mask_stack[--vm->mask_sp] == 0) {
+                    /* variable 0 is unused: B_used K d */
+                    if (used == 0)
+                        d = pair(COMB_K, d);
+                    else {
+                        PUSH(d);
+                        d = bulk(COMB_B, used);
+                        d = pair(d, COMB_K);
+                        d = pair(d, POP);
+                    }
+                }
+                else
+                    used--;
+            }
+        }
+        else if (frame == KI_NATIVE)
+            d = pair(POP, d);
+        else if (frame == KI_FUN) {
+            t = TOP;
+            TOP = d;
+            PUSH(mkint(n));
+            PUSH(KI_ARG);
+            goto descend;
+        }
+        else {  /* KI_ARG */
+            int n1 = intof(POP);
+            d = kiselyov_app(n1, POP, n, d, &n, &used);
+        }
+    }
+    return d;
+}
+
+/* Translates a parsed term, or the body of a LAZY thunk. */
+Cell translate_term(Cell t)
+{
+    return vm->kiselyov_mode ? kiselyov(t) : translate(t);
+}
+
+/* Parses the program, and translates it unless the Krivine machine
+ * runs it. */
+Cell load_program(void)
+{
+    double start = wall_clock();
+    Cell t = parse();
+    input_align();
+    if (islazy(t))
+        t = cdr(t);     /* the whole program is needed at once */
+    vm->parse_time = wall_clock() - start;
+    if (vm->engine == ENGINE_KAM)
+        return t;
+    start = wall_clock();
+    t = translate_term(t);
+    vm->translate_time = wall_clock() - start;
+    return t;
+}
+
+/* SHARING
+ *
+ *  With -s, structurally identical subgraphs of the loaded program are
+ *  merged, so that common parts (the same variable at the same depth,
+ *  library functions inlined several times, ...) are stored and reduced
+ *  only once. The program graph is closed, so any two equal subgraphs
+ *  denote the same value.
+ *
+ *  share works on the result of gc_full: every cell is in the old
+ *  generation, so the children can be rewritten without the write
+ *  barrier. The graph is traversed in post order with canonical
+ *  children substituted before their parent is looked up in a hash
+ *  table; no cells are allocated.
+ */
+
+Cell *share_slot(Cell *table, uintptr_t mask, Cell c)
+{
+    uintptr_t h = ((uintptr_t)car(c) >> 2) * 2654435761u + ((uintptr_t)cdr(c) >> 2);
+    Cell *slot;
+
+    h ^= h >> 15;
+    for (slot = &table[h & mask]; *slot != NIL; slot = &table[h & mask]) {
+        if (car(*slot) == car(c) && cdr(*slot) == cdr(c))
+            break;
+        h++;
+    }
+    return slot;
+}
+
+Cell share(Cell root, int ncells)
+{
+    Cell *bottom = vm->rd_stack.sp;
+    Cell *table, *slot;
+    Cell t = root;
+    uintptr_t i, size;
+
+    for (size = 1024; size < (uintptr_t)ncells * 2; size *= 2)
+        ;
+    table = malloc(size * sizeof(Cell));
+    if (table == NULL)
+        errexit("Cannot allocate sharing table (%d entries)\n", (int)size);
+    for (i = 0; i < size; i++)
+        table[i] = NIL;
+
+  descend:
+    while (ispair(t) && *share_slot(table, size - 1, t) != t) {
+        PUSH(t);
+        PUSH(SH_FUN);
+        t = car(t);
+    }
+
+    while (vm->rd_stack.sp != bottom) {
+        Cell frame = POP;
+        if (frame == SH_FUN) {
+            car(TOP) = t;
+            t = cdr(TOP);
+            PUSH(SH_ARG);
+            goto descend;
+        }
+        else {  /* SH_ARG */
+            cdr(TOP) = t;
+            t = POP;
+            slot = share_slot(table, size - 1, t);
+            if (*slot == NIL)
+                *slot = t;
+            t = *slot;
+        }
+    }
+    free(table);
+    return t;
+}
+
+void unparse(Cell e)
+{
+    Cell *bottom = vm->rd_stack.sp;
+
+    PUSH(e);
+    while (vm->rd_stack.sp != bottom) {
+        e = POP;
+        if (ispair(e)) {
+            putchar('`');
+            PUSH(cdr(e));
+            PUSH(car(e));
+        }
+        else if (e == COMB_S) putchar('S');
+        else if (e == COMB_K) putchar('K');
+        else if (e == COMB_I) putchar('I');
+        else if (e == COMB_B) putchar('B');
+        else if (e == COMB_C) putchar('C');
+        else if (e == COMB_SP) printf("S'");
+        else if (e == COMB_BS) printf("B*");
+        else if (e == COMB_CP) printf("C'");
+        else if (e == COMB_KI) printf("`ki");
+        else if (e == COMB_SUCC || e == COMB_SUCC2) printf("SUCC");
+        else if (e == COMB_PRED) printf("PRED");
+        else if (e == COMB_ISZERO) printf("ISZERO");
+        else if (e == COMB_ADD) printf("ADD");
+        else if (e == COMB_SUB) printf("SUB");
+        else if (e == COMB_MUL) printf("MUL");
+        else if (e == COMB_BN) printf("Bn");
+        else if (e == COMB_CN) printf("Cn");
+        else if (e == COMB_SN) printf("Sn");
+        else if (ischar(e)) printf("#%d", (int)charof(e));
+        else putchar('?');
+    }
+}
+
+/**********************************************************************
+ *  Program cache and snapshots
+ **********************************************************************/
+
+/* With -c FILE, the translated program is saved in FILE, and later runs
+ * whose program consists of the same bytes load it from there instead of
+ * parsing and translating it again.
+ *
+ * FILE holds an ImageHeader followed by the cells of the program graph
+ * (as compacted by gc_full), with pointers replaced by byte offsets from
+ * the first cell; immediates are stored as they are. The file is mapped
+ * copy-on-write and relocated in place. The mapped cells work as old
+ * generation cells until the next major collection copies them into the
+ * heap, after which the mapping is released.
+ *
+ * To validate the cache, the number of program bytes recorded in it are
+ * read and hashed. If they do not match, the bytes are given back to the
+ * input and the program is loaded as usual. So is the program when a cell
+ * of the image (or its root) is not one image_save could have written: a
+ * pair offset outside the cells, a combinator or immediate the reducer
+ * does not know, or a negative number.
+ *
+ * A snapshot (-S FILE) is an image of the whole machine taken when the
+ * program first demands input or prints a character: the heap reachable
+ * from rd_stack, followed by the stack itself. Nothing has depended on
+ * the input yet at that point, so the snapshot is validated against the
+ * program bytes just like the cache, and a later run resumes evaluation
+ * from it without repeating the reductions before the checkpoint. Frame
+ * bottoms on the stack are depths from STACK_TOP, so the stack is simply
+ * copied back to the same depth. Its entries are checked like the cells,
+ * and the frames they hold followed out to the bottom of the stack; a
+ * snapshot that fails is ignored and the run starts afresh. */
+
+#define IMAGE_MAGIC     "CLAMBIMG"
+#define SNAPSHOT_MAGIC  "CLAMBSNP"
+#define IMAGE_VERSION   1
+#define IMAGE_CELLS     128     /* file offset of the cells */
+
+/* translation options that affect the graph */
+#define IMAGE_KISELYOV  1
+#define IMAGE_SHARE     2
+#define IMAGE_LAZY      4
+#define IMAGE_KAM       8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cell_size;         /* sizeof(Pair) */
+    uint32_t num_combs;
+    uint32_t options;
+    uint64_t num_cells;
+    uint64_t root;              /* program images only */
+    uint64_t source_size;       /* number of program bytes */
+    uint64_t source_hash;
+    uint64_t stack_depth;       /* snapshots only */
+    uint64_t bottom_depth;
+} ImageHeader;
+
+uint32_t image_options(void)
+{
+    return (vm->kiselyov_mode ? IMAGE_KISELYOV : 0) |
+           (vm->share_mode ? IMAGE_SHARE : 0) |
+           (vm->lazy_mode ? IMAGE_LAZY : 0) |
+           (vm->engine == ENGINE_KAM ? IMAGE_KAM : 0);
+}
+
+/* A pointer is stored as its difference from REF(base). */
+Cell image_encode(Cell c, Pair *base)
+{
+    return ispair(c) ? CELL((uintptr_t)c - (uintptr_t)REF(base)) : c;
+}
+
+Cell image_decode(Cell c, Pair *base)
+{
+    return ispair(c) ? CELL((uintptr_t)REF(base) + (uintptr_t)c) : c;
+}
+
+/* Returns whether c, as stored in an image of num_cells cells, is a pair
+ * of the image or a constant of the program graph. */
+int image_cell_valid(Cell c, uint64_t num_cells)
+{
+    uintptr_t unit = (uintptr_t)REF(vm->heap_base + 1) - (uintptr_t)REF(vm->heap_base);
+
+    if (ispair(c))
+        return (uintptr_t)c % unit == 0 && (uintptr_t)c / unit < num_cells;
+    if (isint(c))
+        return intof(c) >= 0;
+    if (iscomb(c))      /* compiled terms are reverted before saving */
+        return combof(c) >= 0 && combof(c) < C_JIT;
+    if (ischar(c))
+        return charof(c) >= 0;
+    return c == NIL || c == LAMBDA || c == FRAME_INC || c == FRAME_PUTC;
+}
+
+/* Returns whether the stack entries of a snapshot hold valid cells and,
+ * from the bottom of the current frame out, a chain of frames as pushed
+ * by PUSH_FRAME: a kind over the depth of the enclosing frame's bottom. */
+int image_stack_valid(const ImageHeader *h, const Cell *stack)
+{
+    uint64_t i, d;
+
+#define AT_DEPTH(d)     stack[h->stack_depth - (d)]
+    for (i = 0; i < h->stack_depth; i++) {
+        if (!image_cell_valid(stack[i], h->num_cells))
+            return 0;
+    }
+    if (h->stack_depth <= h->bottom_depth)     /* no value on the frame */
+        return 0;
+    for (d = h->bottom_depth; d > 0; d = intof(AT_DEPTH(d - 1))) {
+        if (d < 2 || (AT_DEPTH(d) != FRAME_INC && AT_DEPTH(d) != FRAME_PUTC) ||
+            !isint(AT_DEPTH(d - 1)) || (uint64_t)intof(AT_DEPTH(d - 1)) > d - 2)
+            return 0;
+    }
+#undef AT_DEPTH
+    return 1;
+}
+
+int write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int write_encoded(int fd, Cell *cells, size_t n)
+{
+    Cell chunk[2048];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        len = n - i < 2048 ? n - i : 2048;
+        for (j = 0; j < len; j++)
+            chunk[j] = image_encode(cells[i + j], vm->old_area);
+        if (write_all(fd, chunk, sizeof(Cell) * len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Compacts the heap and writes it to path, with *root as the root of a
+ * program image, or with rd_stack and the frame bottom for a snapshot
+ * (root == NULL). The file is written under a temporary name and renamed,
+ * so that concurrent runs never see a partial image. A failure is
+ * reported but does not stop the program. */
+void image_save(const char *path, Cell *root, Cell *bottom)
+{
+    char header[IMAGE_CELLS], tmp[4096];
+    ImageHeader *h = (ImageHeader *)header;
+    int n, fd;
+
+    jit_revert();
+    n = gc_full(root);
+    memset(header, 0, sizeof(header));
+    memcpy(h->magic, root ? IMAGE_MAGIC : SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = IMAGE_VERSION;
+    h->cell_size = sizeof(Pair);
+    h->num_combs = NUM_COMBS;
+    h->options = image_options();
+    h->num_cells = n;
+    h->source_size = vm->input.nhashed;
+    h->source_hash = vm->input.hash;
+    if (root)
+        h->root = (uint64_t)(uintptr_t)image_encode(*root, vm->old_area);
+    else {
+        h->stack_depth = STACK_TOP - vm->rd_stack.sp;
+        h->bottom_depth = STACK_TOP - bottom;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        goto fail;
+    if (write_all(fd, header, sizeof(header)) < 0 ||
+        write_encoded(fd, (Cell *)vm->old_area, 2 * (size_t)n) < 0 ||
+        (!root && write_encoded(fd, vm->rd_stack.sp, h->stack_depth) < 0))
+        goto fail;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    if (rename(tmp, path) < 0)
+        goto fail;
+    return;
+
+  fail:
+    fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+}
+
+/* Maps the image at path and relocates its cells, and sets *stack to the
+ * (still encoded) stack entries of a snapshot. Returns NULL if the image
+ * is missing, does not match the program or is corrupt; the input is then
+ * left as it was. Must be called before the first collection, while the old
+ * generation can still be sized to take in the mapped cells. */
+Pair *image_map_file(const char *path, const char *magic, ImageHeader *h,
+                     Cell **stack)
+{
+    struct stat st;
+    unsigned char *src, *map;
+    Pair *cells;
+    size_t i, got;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < IMAGE_CELLS ||
+        pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+        memcmp(h->magic, magic, sizeof(h->magic)) != 0 ||
+        h->version != IMAGE_VERSION || h->cell_size != sizeof(Pair) ||
+        h->num_combs != NUM_COMBS || h->options != image_options() ||
+        h->num_cells >= INT32_MAX || h->stack_depth > RDSTACK_SIZE ||
+        h->bottom_depth > h->stack_depth ||
+        (uint64_t)st.st_size != IMAGE_CELLS + h->num_cells * sizeof(Pair) +
+                                h->stack_depth * sizeof(Cell)) {
+        close(fd);
+        return NULL;
+    }
+
+    src = malloc(h->source_size ? h->source_size : 1);
+    if (src == NULL)
+        errexit("Cannot allocate %lu bytes\n", (unsigned long)h->source_size);
+    got = input_read_hashed(src, h->source_size);
+    if (got != h->source_size || vm->input.hash != h->source_hash) {
+        input_unread(src, got);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        errexit("cannot map %s: %s\n", path, strerror(errno));
+    cells = (Pair *)(map + IMAGE_CELLS);
+    for (i = 0; i < h->num_cells; i++) {
+        if (!image_cell_valid(cells[i].car, h->num_cells) ||
+            !image_cell_valid(cells[i].cdr, h->num_cells))
+            break;
+    }
+    *stack = (Cell *)(map + IMAGE_CELLS + h->num_cells * sizeof(Pair));
+    if (i < h->num_cells || (memcmp(magic, IMAGE_MAGIC, sizeof(h->magic)) == 0 ?
+                             !image_cell_valid((Cell)(uintptr_t)h->root, h->num_cells) :
+                             !image_stack_valid(h, *stack))) {
+        munmap(map, st.st_size);
+        input_unread(src, got);
+        return NULL;
+    }
+    free(src);
+    vm->image_map = (Pair *)map;
+    vm->image_map_size = st.st_size;
+
+#ifdef COMPACT_CELLS
+    /* cells must be in the arena, so they are copied to the old generation */
+    if (vm->old_end - vm->old_ptr < (long)h->num_cells + NURSERY_SIZE) {
+        vm->heap_size = vm->old_ptr - vm->old_area + h->num_cells + NURSERY_SIZE;
+        if (vm->heap_size > vm->heap_max)
+            errexit("Cannot allocate heap storage (%d cells)\n", vm->heap_size);
+        vm->old_end = vm->old_area + vm->heap_size;
+        if (vm->next_heap_size < vm->heap_size)
+            vm->next_heap_size = vm->heap_size;
+    }
+    cells = vm->old_ptr;
+    memcpy(cells, map + IMAGE_CELLS, h->num_cells * sizeof(Pair));
+    vm->old_ptr += h->num_cells;
+#else
+    cells = (Pair *)(map + IMAGE_CELLS);
+    /* the next major collection copies the mapped cells too */
+    if (vm->next_heap_size < vm->heap_size + (int)h->num_cells)
+        vm->next_heap_size = vm->heap_size + h->num_cells;
+    if (vm->next_heap_size > vm->heap_max)
+        errexit("Cannot allocate heap storage (%d cells)\n", vm->next_heap_size);
+#endif
+    for (i = 0; i < h->num_cells; i++) {
+        cells[i].car = image_decode(cells[i].car, cells);
+        cells[i].cdr = image_decode(cells[i].cdr, cells);
+    }
+    return cells;
+}
+
+/* Loads the program from the cache at path into *root. Returns 0 if the
+ * cache cannot be used. */
+int image_load(const char *path, Cell *root)
+{
+    ImageHeader h;
+    Cell *stack;
+    Pair *cells = image_map_file(path, IMAGE_MAGIC, &h, &stack);
+
+    if (cells == NULL)
+        return 0;
+    *root = image_decode((Cell)(uintptr_t)h.root, cells);
+    return 1;
+}
+
+/* Restores rd_stack from the snapshot at path, and returns the bottom of
+ * the current frame, or NULL if the snapshot cannot be used. */
+Cell *snapshot_load(const char *path)
+{
+    ImageHeader h;
+    Cell *stack;
+    Pair *cells = image_map_file(path, SNAPSHOT_MAGIC, &h, &stack);
+    size_t i;
+
+    if (cells == NULL)
+        return NULL;
+    vm->rd_stack.sp = STACK_TOP - h.stack_depth;
+    if (vm->rd_stack.sp < vm->rd_stack.low)
+        vm->rd_stack.low = vm->rd_stack.sp;
+    for (i = 0; i < h.stack_depth; i++)
+        vm->rd_stack.sp[i] = image_decode(stack[i], cells);
+    return STACK_TOP - h.bottom_depth;
+}
+
+/**********************************************************************
+ *  Reduction trace
+ **********************************************************************/
+
+/* REDUCTION TRACE
+ *
+ *  With -DCLAMB_TRACE, -T FILE records every reduction in FILE for
+ *  tools/tracedump: the rule, the depth of the stack, and the node the
+ *  rule applies to, which is PUSHED(1), the combinator applied to its
+ *  first argument. The events are gathered in a buffer of the context,
+ *  so that each thread of -j traces on its own, and written out whenever
+ *  it fills up.
+ *
+ *  A node is named by its index among the cells of the program, which
+ *  are contiguous at the start of the old generation after gc_full or
+ *  template_copy. While tracing, major collections copy these cells
+ *  first and in order (see trace_pin), so the indexes stay valid for the
+ *  whole run, even for cells the reducer has updated. Cells created by
+ *  the reduction are all reported as TRACE_HEAP. Lazy translation is
+ *  turned off, since it would create program code in the heap.
+ *
+ *  The file starts with a TraceHeader and the names of the rules, each
+ *  terminated by a NUL, followed by blocks: a TraceBlock and count items.
+ *  TRACE_PROGRAM is the program, written before its first run, as count
+ *  pairs of 64-bit words and the root. These hold cells with a pair
+ *  replaced by its index shifted over the tag. TRACE_RUN starts a run and
+ *  has no items, and TRACE_EVENTS holds count TraceEvents. Everything is
+ *  in the byte order of the machine.
+ */
+
+#ifdef CLAMB_TRACE
+#define TRACE_MAGIC     "CLAMBTRC"
+#define TRACE_VERSION   1
+
+enum { TRACE_PROGRAM = 1, TRACE_RUN, TRACE_EVENTS };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_rules;
+} TraceHeader;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t count;
+} TraceBlock;
+
+extern const char *rule_names[NUM_PROFILE];
+
+void trace_write(const void *buf, size_t size)
+{
+    if (fwrite(buf, 1, size, vm->trace->fp) != size)
+        vm->trace->error = 1;
+}
+
+void trace_flush(void)
+{
+    Trace *t = vm->trace;
+    TraceBlock b = { TRACE_EVENTS, t->len };
+
+    if (t->len == 0)
+        return;
+    trace_write(&b, sizeof(b));
+    trace_write(t->buf, sizeof(TraceEvent) * t->len);
+    t->len = 0;
+}
+
+static inline void trace_event(int rule, Cell node)
+{
+    Trace *t = vm->trace;
+    uintptr_t depth = STACK_TOP - vm->rd_stack.sp;
+    uint32_t id = TRACE_HEAP;
+
+    if (ispair(node) && (uintptr_t)(PTR(node) - t->base) < t->size)
+        id = PTR(node) - t->base;
+    if (depth > TRACE_DEPTH_MAX)
+        depth = TRACE_DEPTH_MAX;
+    t->buf[t->len].info = (uint32_t)rule << 24 | depth;
+    t->buf[t->len].node = id;
+    if (++t->len == TRACE_BUFSIZE)
+        trace_flush();
+}
+
+uint64_t trace_encode(Cell c)
+{
+    if (ispair(c))
+        return (uint64_t)(PTR(c) - vm->trace->base) << 2;
+    return (uint64_t)(int64_t)(CellInt)c;
+}
+
+/* Starts tracing a run of the program in the size cells from base, and
+ * opens the trace file at the first run. */
+void trace_run(Cell root, Pair *base, int size)
+{
+    Trace *t = vm->trace;
+    TraceBlock b;
+    uint64_t chunk[2048];
+    int i, j, len;
+
+    if (t == NULL) {
+        TraceHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+        h.version = TRACE_VERSION;
+        h.num_rules = NUM_PROFILE;
+        if ((t = calloc(1, sizeof(Trace))) == NULL)
+            errexit("Cannot allocate trace buffer\n");
+        if ((t->fp = fopen(vm->trace_file, "wb")) == NULL) {
+            free(t);
+            errexit("cannot open %s\n", vm->trace_file);
+        }
+        vm->trace = t;
+        trace_write(&h, sizeof(h));
+        for (i = 0; i < NUM_PROFILE; i++)
+            trace_write(rule_names[i], strlen(rule_names[i]) + 1);
+    }
+    trace_flush();
+    t->base = base;
+    t->size = size;
+    if (!t->program_written) {
+        b.kind = TRACE_PROGRAM;
+        b.count = size;
+        trace_write(&b, sizeof(b));
+        for (i = 0; i < size; i += len) {
+            len = size - i < 1024 ? size - i : 1024;
+            for (j = 0; j < len; j++) {
+                chunk[2 * j] = trace_encode(base[i + j].car);
+                chunk[2 * j + 1] = trace_encode(base[i + j].cdr);
+            }
+            trace_write(chunk, sizeof(uint64_t) * 2 * len);
+        }
+        chunk[0] = trace_encode(root);
+        trace_write(chunk, sizeof(uint64_t));
+        t->program_written = 1;
+    }
+    b.kind = TRACE_RUN;
+    b.count = 0;
+    trace_write(&b, sizeof(b));
+}
+
+/* Copies the program cells to the front of the to-space of a major
+ * collection, in their order. */
+void trace_pin(void)
+{
+    Trace *t = vm->trace;
+    Pair *base = vm->to_ptr;
+    uint32_t i;
+
+    for (i = 0; i < t->size; i++)
+        copy_one(REF(t->base + i));
+    t->base = base;
+}
+
+/* Writes out the buffered events and closes the trace file. A failure
+ * is reported but does not stop the program. */
+void trace_close(void)
+{
+    Trace *t = vm->trace;
+
+    if (t == NULL)
+        return;
+    trace_flush();
+    if (fclose(t->fp) != 0 || t->error)
+        fprintf(stderr, "cannot write trace %s\n", vm->trace_file);
+    vm->trace = NULL;
+    free(t);
+}
+#endif
+
+/**********************************************************************
+ *  Compiled terms
+ **********************************************************************/
+
+/* COMPILED TERMS
+ *
+ *  With -X jit=N, the terms the reducer applies most often are compiled
+ *  into single reductions. Every JIT_INTERVAL reductions, eval samples
+ *  the term its next rule applies: the combinator with all but its last
+ *  argument, such as S f g for S f g x. A term of the old generation
+ *  sampled N times is compiled by reducing it symbolically, applied to
+ *  unknown arguments, with the rules of eval (see jit_step). It takes
+ *  arguments as the rules need them, up to JIT_MAX_ARGS and as many as
+ *  the sample had. The reduction stops at a rule that needs to know an
+ *  argument (an argument at the head, a number, I/O), at a redex without
+ *  arguments in it, since eval reduces those once for all applications,
+ *  or after JIT_MAX_STEPS reductions.
+ *
+ *  A JitCode records the effect of these reductions: the cells they left
+ *  reachable, the application nodes PUSHED(n) they set, and what becomes
+ *  TOP. The term is then overwritten with JIT NUM(i), i being the index
+ *  of the code, and the JIT rule applies it: one alloc for all the cells,
+ *  no unwinding of the intermediate spines, and the reductions it stands
+ *  for are counted. Applied to fewer arguments than it takes, it reduces
+ *  a copy of the original term instead.
+ *
+ *  An operand of a code is either a cell of the heap, which the collector
+ *  treats as a root, or a hole: an immediate numbering a new cell, an
+ *  argument or an application node PUSHED(n), which the JIT rule fills
+ *  in. A term with an immediate in it is not compiled. The term itself is
+ *  only referred to weakly, and its code is dropped once a major
+ *  collection finds it garbage. The others last until the heap is emptied
+ *  for the next run; image_save puts the original terms back, since
+ *  images cannot hold codes.
+ */
+
+#define JIT_INTERVAL    127             /* reductions between samples */
+#define JIT_MAX_STEPS   64
+#define JIT_MIN_STEPS   6               /* eval does fewer as fast */
+#define JIT_MAX_NODES   512
+#define JIT_MAX_CODES   4096
+#define JIT_MAX_CELLS   128             /* made by one application */
+
+/* the holes: the new cells, then ARG(k), then PUSHED(k) */
+#define JIT_ARG_HOLE(k)         (JIT_MAX_CELLS + (k))
+#define JIT_PUSHED_HOLE(k)      (JIT_MAX_CELLS + JIT_MAX_ARGS + (k))
+#define JIT_HOLES               (JIT_MAX_CELLS + 2 * JIT_MAX_ARGS + 2)
+#define JIT_FILL(holes, x)      (isimm(x) ? (holes)[(CellInt)(x) >> 3] : (x))
+
+/* The symbolic reduction works on a graph of JitNodes: the new cells
+ * (NEW), the unknown arguments (VAR), the application nodes of the
+ * arguments to the term (SPINE, k being the number of arguments), and
+ * cells of the heap (CONST), which it only reads. */
+enum { JN_NEW, JN_SPINE, JN_VAR, JN_CONST };
+
+typedef struct {
+    int kind;
+    int k;                      /* of a SPINE or VAR */
+    int car, cdr;               /* of a NEW or SPINE */
+    Cell cell;                  /* of a CONST */
+    int updated;                /* a SPINE set by the reduction */
+    Cell out;                   /* operand, or NIL */
+} JitNode;
+
+typedef struct {
+    JitNode node[JIT_MAX_NODES];
+    int num;
+    int full;                   /* ran out of nodes or stack */
+    int stack[JIT_MAX_NODES];   /* stack[sp - 1] is the top */
+    int sp;
+    int spine[JIT_MAX_ARGS + 1];
+    int nargs, max_args;
+    int cells[JIT_MAX_CELLS];   /* the NEW nodes in the code */
+    int num_cells;
+} JitModel;
+
+int jit_node(JitModel *m, int kind, int car, int cdr, Cell cell)
+{
+    JitNode *n;
+
+    if (m->num == JIT_MAX_NODES) {
+        m->full = 1;
+        return 0;
+    }
+    n = &m->node[m->num];
+    n->kind = kind;
+    n->k = 0;
+    n->car = car;
+    n->cdr = cdr;
+    n->cell = cell;
+    n->updated = 0;
+    n->out = NIL;
+    return m->num++;
+}
+
+/* A compiled term is read as its original. */
+Cell jit_deref(Cell c)
+{
+    return ispair(c) && car(c) == COMB_JIT ? vm->jit_codes[intof(cdr(c))]->orig : c;
+}
+
+int jit_const(JitModel *m, Cell c)
+{
+    return jit_node(m, JN_CONST, 0, 0, jit_deref(c));
+}
+
+#define JN(x)           (m->node[x])
+#define JN_ISPAIR(x)    (JN(x).kind == JN_NEW || JN(x).kind == JN_SPINE || \
+                         (JN(x).kind == JN_CONST && ispair(JN(x).cell)))
+#define JN_PAIR(a, d)   jit_node(m, JN_NEW, a, d, NIL)
+
+int jit_car(JitModel *m, int x)
+{
+    return JN(x).kind == JN_CONST ? jit_const(m, car(JN(x).cell)) : JN(x).car;
+}
+
+int jit_cdr(JitModel *m, int x)
+{
+    return JN(x).kind == JN_CONST ? jit_const(m, cdr(JN(x).cell)) : JN(x).cdr;
+}
+
+void jit_set(JitModel *m, int x, int car, int cdr)
+{
+    JN(x).car = car;
+    JN(x).cdr = cdr;
+    JN(x).updated = JN(x).kind == JN_SPINE;
+}
+
+void jit_push(JitModel *m, int x)
+{
+    if (m->sp == JIT_MAX_NODES)
+        m->full = 1;
+    else
+        m->stack[m->sp++] = x;
+}
+
+/* Applies the term to one more argument, below the bottom of the stack. */
+int jit_extend(JitModel *m)
+{
+    int k, s;
+
+    if (m->nargs == m->max_args || m->sp == JIT_MAX_NODES)
+        return 0;
+    k = ++m->nargs;
+    s = jit_node(m, JN_SPINE, m->spine[k - 1], jit_node(m, JN_VAR, 0, 0, NIL), NIL);
+    JN(s).k = JN(JN(s).cdr).k = k;
+    m->spine[k] = s;
+    memmove(m->stack + 1, m->stack, sizeof(int) * m->sp);
+    m->stack[0] = s;
+    m->sp++;
+    return !m->full;
+}
+
+#define M_TOP           (m->stack[m->sp - 1])
+#define M_PUSHED(n)     (m->stack[m->sp - 1 - (n)])
+#define M_ARG(n)        jit_cdr(m, M_PUSHED(n))
+#define M_DROP(n)       (m->sp -= (n))
+
+/* Does one reduction of eval on the model, returning 0 if it stops. */
+int jit_step(JitModel *m)
+{
+    int c, n = 0, i, a, x, y;
+
+    while (JN_ISPAIR(M_TOP) && !m->full)
+        jit_push(m, jit_car(m, M_TOP));
+    if (m->full || JN(M_TOP).kind != JN_CONST || !iscomb(JN(M_TOP).cell))
+        return 0;
+    switch (c = combof(JN(M_TOP).cell)) {
+    case C_I: case C_IOTA:
+        a = 1;
+        break;
+    case C_K: case C_KI:
+        a = 2;
+        break;
+    case C_S: case C_B: case C_C: case C_CONS:
+        a = 3;
+        break;
+    case C_SP: case C_BS: case C_CP:
+        a = 4;
+        break;
+    case C_BN: case C_CN: case C_SN:
+        if (m->sp <= 1 && !jit_extend(m))
+            return 0;
+        x = M_ARG(1);
+        if (JN(x).kind != JN_CONST || !isint(JN(x).cell))
+            return 0;
+        n = intof(JN(x).cell);
+        if (n < 1 || n > JIT_MAX_ARGS)
+            return 0;
+        a = n + 3;
+        break;
+    default:
+        return 0;
+    }
+    while (m->sp <= a) {
+        if (!jit_extend(m))
+            return 0;
+    }
+    if (c != C_I && JN(M_PUSHED(a)).kind == JN_CONST)
+        return 0;       /* no argument in the redex */
+
+    switch (c) {
+    case C_I:
+        M_DROP(1);
+        M_TOP = jit_cdr(m, M_TOP);
+        break;
+    case C_S:
+        x = JN_PAIR(M_ARG(1), M_ARG(3));
+        y = JN_PAIR(M_ARG(2), M_ARG(3));
+        M_DROP(3);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_K:
+        x = M_ARG(1);
+        M_DROP(2);
+        jit_set(m, M_TOP, jit_const(m, COMB_I), x);
+        M_TOP = x;
+        break;
+    case C_B:
+        x = M_ARG(1);
+        y = JN_PAIR(M_ARG(2), M_ARG(3));
+        M_DROP(3);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_C:
+        x = JN_PAIR(M_ARG(1), M_ARG(3));
+        y = M_ARG(2);
+        M_DROP(3);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_SP:
+        x = JN_PAIR(M_ARG(1), JN_PAIR(M_ARG(2), M_ARG(4)));
+        y = JN_PAIR(M_ARG(3), M_ARG(4));
+        M_DROP(4);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_BS:
+        x = M_ARG(1);
+        y = JN_PAIR(M_ARG(2), JN_PAIR(M_ARG(3), M_ARG(4)));
+        M_DROP(4);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_CP:
+        x = JN_PAIR(M_ARG(1), JN_PAIR(M_ARG(2), M_ARG(4)));
+        y = M_ARG(3);
+        M_DROP(4);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_IOTA:
+        x = JN_PAIR(M_ARG(1), jit_const(m, COMB_S));
+        M_DROP(1);
+        jit_set(m, M_TOP, x, jit_const(m, COMB_K));
+        break;
+    case C_KI:
+        M_DROP(2);
+        jit_set(m, M_TOP, jit_const(m, COMB_I), jit_cdr(m, M_TOP));
+        break;
+    case C_CONS:
+        x = JN_PAIR(M_ARG(3), M_ARG(1));
+        y = M_ARG(2);
+        M_DROP(3);
+        jit_set(m, M_TOP, x, y);
+        break;
+    case C_BN:
+    case C_CN:
+        x = JN_PAIR(M_ARG(c == C_BN ? 3 : 2), M_ARG(4));
+        for (i = 1; i < n; i++)
+            x = JN_PAIR(x, M_ARG(4 + i));
+        y = M_ARG(c == C_BN ? 2 : 3);
+        M_DROP(n + 3);
+        if (c == C_BN)
+            jit_set(m, M_TOP, y, x);
+        else
+            jit_set(m, M_TOP, x, y);
+        break;
+    case C_SN:
+        x = JN_PAIR(M_ARG(2), M_ARG(4));
+        y = JN_PAIR(M_ARG(3), M_ARG(4));
+        for (i = 1; i < n; i++) {
+            x = JN_PAIR(x, M_ARG(4 + i));
+            y = JN_PAIR(y, M_ARG(4 + i));
+        }
+        M_DROP(n + 3);
+        jit_set(m, M_TOP, x, y);
+        break;
+    }
+    return !m->full;
+}
+
+/* Whether stack[i] is what unwinding stack[i - 1] pushes. Above the last
+ * entry that is not, eval can unwind the stack again by itself. */
+int jit_unwound(JitModel *m, int i)
+{
+    JitNode *p = &JN(m->stack[i - 1]), *c = &JN(m->stack[i]);
+
+    if (p->kind != JN_CONST)
+        return p->car == m->stack[i];
+    return c->kind == JN_CONST && c->cell == jit_deref(car(p->cell));
+}
+
+/* Returns the operand for node x, numbering the new cells it reaches. */
+Cell jit_out(JitModel *m, int x)
+{
+    if (JN(x).out != NIL)
+        return JN(x).out;
+    switch (JN(x).kind) {
+    case JN_VAR:
+        return JN(x).out = mkimm(JIT_ARG_HOLE(JN(x).k));
+    case JN_SPINE:
+        return JN(x).out = mkimm(JIT_PUSHED_HOLE(JN(x).k + 1));
+    case JN_CONST:
+        if (isimm(JN(x).cell))
+            m->full = 1;
+        return JN(x).out = JN(x).cell;
+    }
+    if (m->num_cells == JIT_MAX_CELLS) {
+        m->full = 1;
+        return NIL;
+    }
+    JN(x).out = mkimm(m->num_cells);
+    m->cells[m->num_cells++] = x;
+    jit_out(m, JN(x).car);
+    jit_out(m, JN(x).cdr);
+    return JN(x).out;
+}
+
+/* Compiles the term at *slot, applied to up to avail arguments below it
+ * on the stack. Returns 0 if it is not worth it. */
+int jit_compile(Cell *slot, int avail)
+{
+    JitModel *m;
+    JitCode *code;
+    Cell orig, r;
+    Cell *op;
+    int i, k, id, steps = 0, nupdates = 0, nstack, num_ops;
+
+    if (vm->jit_codes == NULL &&
+        (vm->jit_codes = malloc(sizeof(JitCode *) * JIT_MAX_CODES)) == NULL)
+        return 0;
+    for (id = 0; id < vm->num_jit_codes && vm->jit_codes[id]; id++)
+        ;
+    if (id == JIT_MAX_CODES || (m = malloc(sizeof(JitModel))) == NULL)
+        return 0;
+    orig = pair(car(*slot), cdr(*slot));    /* before the model holds cells */
+    r = *slot;
+
+    m->num = m->full = m->sp = m->nargs = m->num_cells = 0;
+    m->max_args = avail < JIT_MAX_ARGS ? avail : JIT_MAX_ARGS;
+    m->spine[0] = jit_const(m, r);
+    jit_extend(m);
+    while (steps < JIT_MAX_STEPS && jit_step(m))
+        steps++;
+    if (m->full || steps < JIT_MIN_STEPS) {
+        free(m);
+        return 0;
+    }
+
+    for (nstack = m->sp; nstack > 1 && jit_unwound(m, nstack - 1); nstack--)
+        ;
+    for (i = 0; i < nstack; i++)
+        jit_out(m, m->stack[i]);
+    for (k = 1; k <= m->nargs; k++) {
+        if (JN(m->spine[k]).updated) {
+            jit_out(m, JN(m->spine[k]).car);
+            jit_out(m, JN(m->spine[k]).cdr);
+            nupdates++;
+        }
+    }
+    num_ops = 2 * m->num_cells + 3 * nupdates + nstack;
+    if (m->full || (code = malloc(sizeof(JitCode) + sizeof(Cell) * num_ops)) == NULL) {
+        free(m);
+        return 0;
+    }
+    code->arity = m->nargs;
+    code->steps = steps;
+    code->ncells = m->num_cells;
+    code->nupdates = nupdates;
+    code->nstack = nstack;
+    code->node = r;
+    code->orig = orig;
+    code->num_ops = num_ops;
+    op = code->ops;
+    for (i = 0; i < m->num_cells; i++) {
+        *op++ = JN(JN(m->cells[i]).car).out;
+        *op++ = JN(JN(m->cells[i]).cdr).out;
+    }
+    for (k = 1; k <= m->nargs; k++) {
+        if (JN(m->spine[k]).updated) {
+            *op++ = mkimm(JIT_PUSHED_HOLE(k + 1));
+            *op++ = JN(JN(m->spine[k]).car).out;
+            *op++ = JN(JN(m->spine[k]).cdr).out;
+        }
+    }
+    for (i = 0; i < nstack; i++)
+        *op++ = JN(m->stack[i]).out;
+    free(m);
+
+    vm->jit_codes[id] = code;
+    if (id == vm->num_jit_codes)
+        vm->num_jit_codes++;
+    vm->jit_compiled++;
+    SET(r, COMB_JIT, mkint(id));
+    return 1;
+}
+
+/* Counts the term the next rule of eval applies, and compiles it once it
+ * has been seen jit_threshold times. */
+void jit_sample(Cell *bottom)
+{
+    JitSample *s;
+    Cell r, *slot;
+    int a;
+
+    if (vm->jit_samples == NULL &&
+        (vm->jit_samples = calloc(JIT_SAMPLES, sizeof(JitSample))) == NULL)
+        return;
+    while (ispair(TOP))
+        PUSH(car(TOP));
+    switch (iscomb(TOP) ? combof(TOP) : -1) {
+    case C_K: case C_KI:
+        a = 2;
+        break;
+    case C_S: case C_B: case C_C: case C_CONS:
+        a = 3;
+        break;
+    case C_SP: case C_BS: case C_CP:
+        a = 4;
+        break;
+    case C_BN: case C_CN: case C_SN:
+        if (!APPLICABLE(1) || !isint(ARG(1)))
+            return;
+        a = intof(ARG(1)) + 3;
+        break;
+    default:
+        return;
+    }
+    if (!APPLICABLE(a))
+        return;
+    /* a closure made by the reduction is compiled as the term it applies */
+    for (a--; a > 0 && is_young(PUSHED(a)); a--)
+        ;
+    if (a == 0)
+        return;
+    slot = &PUSHED(a);
+    r = *slot;
+    s = &vm->jit_samples[((uint32_t)(uintptr_t)r * 2654435761u >> 8) & (JIT_SAMPLES - 1)];
+    if (s->node != r) {
+        s->node = r;
+        s->count = 0;
+    }
+    if (s->count < 0 || ++s->count < vm->jit_threshold)
+        return;
+    if (jit_compile(slot, bottom - slot - 1))
+        vm->rd_stack.sp = slot;     /* the cells above held the spine of r */
+    else
+        s->count = -1;
+}
+
+/* Drops all the codes, when their terms are garbage. */
+void jit_free(void)
+{
+    int i;
+
+    for (i = 0; i < vm->num_jit_codes; i++)
+        free(vm->jit_codes[i]);
+    vm->num_jit_codes = 0;
+    if (vm->jit_samples)
+        memset(vm->jit_samples, 0, sizeof(JitSample) * JIT_SAMPLES);
+}
+
+/* Puts back the original terms of the compiled ones, and drops them. */
+void jit_revert(void)
+{
+    int i;
+
+    for (i = 0; i < vm->num_jit_codes; i++) {
+        JitCode *code = vm->jit_codes[i];
+        if (code)
+            SET(code->node, car(code->orig), cdr(code->orig));
+    }
+    jit_free();
+}
+
+/**********************************************************************
+ *  Reducer
+ **********************************************************************/
+
+/* Rules are selected by combof(TOP). With GCC and Clang this is a
+ * computed goto through rule_table; other compilers (or -DNO_COMPUTED_GOTO)
+ * get a switch. Each rule checks its own arity with REQUIRE. */
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#define DISPATCH(n)     goto *rule_table[n];
+#define RULE(c)         L_##c:
+#define END_RULES
+#else
+#define DISPATCH(n)     switch (n) {
+#define RULE(c)         case c:
+#define END_RULES       default: goto done; }
+#endif
+#define REQUIRE(n) \
+    if (!APPLICABLE(n)) goto done; \
+    PROFILE(combof(TOP)); TRACE(combof(TOP), PUSHED(1))
+
+#define NATIVE_MAX      (CELLINT_MAX >> 4)
+
+/* Sets check_at, where eval next yields, takes a JIT sample (if sampling)
+ * or polls the output for flush-delay. The counters are compared with >=,
+ * so a compiled term that counts several reductions at once passes
+ * check_at no further than to the next check. */
+void eval_schedule(int sampling)
+{
+    long long interval = sampling ? JIT_INTERVAL :
+                         vm->flush_delay ? OUTPUT_POLL : 0;
+
+    vm->check_at = interval && vm->yield_at - vm->reductions > interval ?
+        vm->reductions + interval : vm->yield_at;
+}
+
+/* Does what is due at check_at, short of yielding. bottom is NULL for
+ * the Krivine machine, which takes no JIT samples. */
+void eval_check(Cell *bottom)
+{
+    int sampling = vm->jit_threshold && bottom;
+
+    if (vm->flush_delay && vm->reductions - vm->out_polled_at >= OUTPUT_POLL) {
+        vm->out_polled_at = vm->reductions;
+        output_poll();
+    }
+    if (sampling)
+        jit_sample(bottom);
+    eval_schedule(sampling);
+}
+
+/* Follows indirections to see whether x is already an immediate. */
+static inline Cell native_value(Cell x)
+{
+    while (ispair(x) && car(x) == COMB_I)
+        x = cdr(x);
+    return x;
+}
+#define NEXT            goto next
+
+/* A continuation frame is pushed when a rule needs the value of a
+ * subexpression (a number for INC and PUTC). It holds the depth of the
+ * enclosing frame's bottom and the kind of the frame; the subexpression
+ * is then evaluated above it by the same loop, and the frame is resumed
+ * when no rule applies any more. */
+#define PUSH_FRAME(kind) \
+    (PUSH(mkint(STACK_TOP - bottom)), PUSH(kind), bottom = vm->rd_stack.sp)
+
+/* Reduces the graph on rd_stack. base is the stack pointer below the
+ * outermost frame, and bottom that of the current frame. Returns 0 when
+ * the outermost frame is done. It also returns, with CLAMB_YIELDED once
+ * vm->yield_at reductions are reached or CLAMB_BLOCKED when READ finds no
+ * input yet, leaving bottom in vm->eval_bottom; calling it again with that
+ * bottom resumes the reduction. */
+int eval(Cell *base, Cell *bottom)
+{
+#ifdef USE_COMPUTED_GOTO
+    static void *rule_table[NUM_COMBS] = {
+        [C_S] = &&L_C_S, [C_K] = &&L_C_K, [C_I] = &&L_C_I,
+        [C_B] = &&L_C_B, [C_C] = &&L_C_C, [C_SP] = &&L_C_SP,
+        [C_BS] = &&L_C_BS, [C_CP] = &&L_C_CP, [C_IOTA] = &&L_C_IOTA,
+        [C_KI] = &&L_C_KI, [C_READ] = &&L_C_READ, [C_WRITE] = &&L_C_WRITE,
+        [C_INC] = &&L_C_INC, [C_CONS] = &&L_C_CONS, [C_PUTC] = &&L_C_PUTC,
+        [C_RETURN] = &&L_C_RETURN, [C_SUCC] = &&L_C_SUCC,
+        [C_SUCC2] = &&L_C_SUCC2, [C_PRED] = &&L_C_PRED,
+        [C_ISZERO] = &&L_C_ISZERO, [C_ADD] = &&L_C_ADD, [C_SUB] = &&L_C_SUB,
+        [C_MUL] = &&L_C_MUL, [C_BN] = &&L_C_BN, [C_CN] = &&L_C_CN,
+        [C_SN] = &&L_C_SN, [C_LAZY] = &&L_C_LAZY, [C_JIT] = &&L_C_JIT,
+    };
+#endif
+    Cell v;
+
+    eval_schedule(vm->jit_threshold);
+    for (;;) {
+        while (ispair(TOP))
+            PUSH(car(TOP));
+
+        if (iscomb(TOP)) {
+            DISPATCH(combof(TOP))
+
+            RULE(C_I)
+            { /* I x -> x */
+                REQUIRE(1);
+                POP;
+                TOP = cdr(TOP);
+                NEXT;
+            }
+            RULE(C_S)
+            { /* S f g x -> f x (g x) */
+                REQUIRE(3);
+                Cell a = alloc(2);
+                SET(CELL_AT(a, 0), ARG(1), ARG(3));         /* f x */
+                SET(CELL_AT(a, 1), ARG(2), ARG(3));         /* g x */
+                DROP(3);
+                SET(TOP, CELL_AT(a, 0), CELL_AT(a, 1));     /* f x (g x) */
+                NEXT;
+            }
+            RULE(C_K)
+            { /* K x y -> I x */
+                REQUIRE(2);
+                Cell x = ARG(1);
+                DROP(2);
+                SET(TOP, COMB_I, x);
+                TOP = cdr(TOP);     /* shortcut reduction of I */
+                NEXT;
+            }
+            RULE(C_B)
+            { /* B f g x -> f (g x) */
+                REQUIRE(3);
+                Cell f, gx;
+                gx = pair(ARG(2), ARG(3));
+                f = ARG(1);
+                DROP(3);
+                SET(TOP, f, gx);
+                NEXT;
+            }
+            RULE(C_C)
+            { /* C f g x -> f x g */
+                REQUIRE(3);
+                Cell fx, g;
+                fx = pair(ARG(1), ARG(3));
+                g = ARG(2);
+                DROP(3);
+                SET(TOP, fx, g);
+                NEXT;
+            }
+            RULE(C_SP)
+            { /* SP c f g x -> c (f x) (g x) */
+                REQUIRE(4);
+                Cell a = alloc(3);
+                SET(CELL_AT(a, 0), ARG(2), ARG(4));         /* f x */
+                SET(CELL_AT(a, 1), ARG(3), ARG(4));         /* g x */
+                SET(CELL_AT(a, 2), ARG(1), CELL_AT(a, 0));  /* c (f x) */
+                DROP(4);
+                SET(TOP, CELL_AT(a, 2), CELL_AT(a, 1));     /* c (f x) (g x) */
+                NEXT;
+            }
+            RULE(C_BS)
+            { /* BS c f g x -> c (f (g x)) */
+                REQUIRE(4);
+                Cell a, c;
+                a = alloc(2);
+                SET(CELL_AT(a, 0), ARG(3), ARG(4));         /* g x */
+                SET(CELL_AT(a, 1), ARG(2), CELL_AT(a, 0));  /* f (g x) */
+                c = ARG(1);
+                DROP(4);
+                SET(TOP, c, CELL_AT(a, 1));                 /* c (f (g x)) */
+                NEXT;
+            }
+            RULE(C_CP)
+            { /* BS c f g x -> c (f x) g */
+                REQUIRE(4);
+                Cell a, g;
+                a = alloc(2);
+                SET(CELL_AT(a, 0), ARG(2), ARG(4));         /* f x */
+                SET(CELL_AT(a, 1), ARG(1), CELL_AT(a, 0));  /* c (f x) */
+                g = ARG(3);
+                DROP(4);
+                SET(TOP, CELL_AT(a, 1), g);                 /* c (f x) g */
+                NEXT;
+            }
+            RULE(C_IOTA)
+            { /* IOTA x -> x S K */
+                REQUIRE(1);
+                Cell xs = pair(ARG(1), COMB_S);
+                POP;
+                SET(TOP, xs, COMB_K);
+                NEXT;
+            }
+            RULE(C_KI)
+            { /* KI x y -> I y */
+                REQUIRE(2);
+                DROP(2);
+                SETCAR(TOP, COMB_I);
+                NEXT;
+            }
+            RULE(C_CONS)
+            { /* CONS x y f -> f x y */
+                REQUIRE(3);
+                Cell fx, y;
+                fx = pair(ARG(3), ARG(1));
+                y = ARG(2);
+                DROP(3);
+                SET(TOP, fx, y);
+                NEXT;
+            }
+            RULE(C_READ)
+            { /* READ NIL f -> CONS CHAR(c1) (CONS CHAR(c2) ... (READ NIL)) f
+                            -> I KI f
+                 * The list takes the bytes already in the buffer, up to
+                 * INPUT_CHUNK, so that it is still read as lazily as the
+                 * input arrives: a line at a time from a terminal. */
+                REQUIRE(2);
+                if (vm->snapshot_pending) {
+                    vm->snapshot_pending = 0;
+                    image_save(vm->snapshot_file, NULL, bottom);
+                }
+                int c = read_char();
+                if (c == EOF && vm->input.would_block) {
+                    /* suspend; the rule is applied again on resumption */
+                    vm->input.would_block = 0;
+                    vm->eval_bottom = bottom;
+                    return CLAMB_BLOCKED;
+                }
+                if (c == EOF) {
+                    POP;
+                    SET(TOP, COMB_I, COMB_KI);
+                }
+                else {
+                    const unsigned char *s = vm->input.ptr - 1;
+                    int i, n = vm->input.end - s;
+                    if (n > INPUT_CHUNK)
+                        n = INPUT_CHUNK;
+                    vm->input.ptr += n - 1;
+                    /* CONS CHAR(c1), (CONS CHAR(c2), ...), ..., READ NIL */
+                    Cell a = alloc(2 * n);
+                    for (i = 0; i < n; i++) {
+                        car(CELL_AT(a, 2 * i)) = COMB_CONS;
+                        cdr(CELL_AT(a, 2 * i)) = mkchar(s[i]);
+                    }
+                    for (i = 1; i < n; i++) {
+                        car(CELL_AT(a, 2 * i - 1)) = CELL_AT(a, 2 * i);
+                        cdr(CELL_AT(a, 2 * i - 1)) = CELL_AT(a, 2 * i + 1);
+                    }
+                    car(CELL_AT(a, 2 * n - 1)) = COMB_READ;
+                    cdr(CELL_AT(a, 2 * n - 1)) = NIL;
+                    POP;
+                    SET(TOP, CELL_AT(a, 0), CELL_AT(a, 1));
+                }
+                NEXT;
+            }
+            RULE(C_WRITE)
+            { /* WRITE x -> x PUTC RETURN */
+                REQUIRE(1);
+                POP;
+                Cell a = pair(cdr(TOP), COMB_PUTC); /* x PUTC */
+                SET(TOP, a, COMB_RETURN);           /* x PUTC RETURN */
+                NEXT;
+            }
+            RULE(C_PUTC)
+            { /* PUTC x y i -> putc(eval(x INC NUM(0))); WRITE y */
+                REQUIRE(3);
+                if (vm->snapshot_pending) {
+                    vm->snapshot_pending = 0;
+                    image_save(vm->snapshot_file, NULL, bottom);
+                }
+                Cell x = native_value(ARG(1));
+                if (ischar(x)) {        /* x is already a number */
+                    DROP(2);
+                    v = mkint(charof(x));
+                    goto put_result;
+                }
+                Cell a = alloc(2);
+                SET(CELL_AT(a, 0), ARG(1), COMB_INC);       /* x INC */
+                SET(CELL_AT(a, 1), CELL_AT(a, 0), mkint(0)); /* x INC NUM(0) */
+                DROP(2);
+                PUSH_FRAME(FRAME_PUTC);
+                PUSH(CELL_AT(a, 1));
+                continue;
+            }
+            RULE(C_RETURN)
+                goto done;
+            RULE(C_INC)
+            { /* INC x -> eval(x)+1 */
+                REQUIRE(1);
+                Cell c = ARG(1);
+                POP;
+                if (isint(c)) {
+                    SET(TOP, COMB_I, mkint(intof(c) + 1));
+                    NEXT;
+                }
+                PUSH_FRAME(FRAME_INC);
+                PUSH(c);
+                continue;
+            }
+            RULE(C_SUCC)
+            RULE(C_SUCC2)
+            RULE(C_PRED)
+            RULE(C_ISZERO)
+            { /* OP g n -> op(n) if n is an immediate
+                         -> g n    otherwise */
+                REQUIRE(2);
+                Cell n = native_value(ARG(2));
+                v = NIL;
+                if (ischar(n)) {
+                    intptr_t i = charof(n);
+                    if (TOP == COMB_ISZERO)
+                        v = i == 0 ? COMB_K : COMB_KI;
+                    else if (TOP == COMB_PRED)
+                        v = mkchar(i > 0 ? i - 1 : 0);
+                    else if (i < NATIVE_MAX)
+                        v = mkchar(i + 1);
+                }
+                if (v != NIL) {
+                    DROP(2);
+                    SET(TOP, COMB_I, v);
+                }
+                else {
+                    Cell g = ARG(1);
+                    n = ARG(2);
+                    DROP(2);
+                    SET(TOP, g, n);
+                }
+                NEXT;
+            }
+            RULE(C_ADD)
+            RULE(C_SUB)
+            RULE(C_MUL)
+            { /* OP g m n -> op(m, n) if m and n are immediates
+                           -> g m n    otherwise */
+                REQUIRE(3);
+                Cell m = native_value(ARG(2)), n = native_value(ARG(3));
+                v = NIL;
+                if (ischar(m) && ischar(n)) {
+                    intptr_t i = charof(m), j = charof(n);
+                    if (TOP == COMB_ADD && i <= NATIVE_MAX - j)
+                        v = mkchar(i + j);
+                    else if (TOP == COMB_SUB)
+                        v = mkchar(i > j ? i - j : 0);
+                    else if (TOP == COMB_MUL && (i == 0 || j <= NATIVE_MAX / i))
+                        v = mkchar(i * j);
+                }
+                if (v != NIL) {
+                    DROP(3);
+                    SET(TOP, COMB_I, v);
+                }
+                else {
+                    Cell gm = pair(ARG(1), ARG(2));
+                    n = ARG(3);
+                    DROP(3);
+                    SET(TOP, gm, n);
+                }
+                NEXT;
+            }
+            RULE(C_BN)
+            { /* BN NUM(n) f g x1..xn -> f (g x1..xn) */
+                int i, n = intof(ARG(1));
+                REQUIRE(n + 3);
+                Cell a = alloc(n);
+                SET(a, ARG(3), ARG(4));
+                for (i = 1; i < n; i++)
+                    SET(CELL_AT(a, i), CELL_AT(a, i-1), ARG(4+i));
+                Cell f = ARG(2);
+                DROP(n + 3);
+                SET(TOP, f, CELL_AT(a, n-1));
+                NEXT;
+            }
+            RULE(C_CN)
+            { /* CN NUM(n) f g x1..xn -> f x1..xn g */
+                int i, n = intof(ARG(1));
+                REQUIRE(n + 3);
+                Cell a = alloc(n);
+                SET(a, ARG(2), ARG(4));
+                for (i = 1; i < n; i++)
+                    SET(CELL_AT(a, i), CELL_AT(a, i-1), ARG(4+i));
+                Cell g = ARG(3);
+                DROP(n + 3);
+                SET(TOP, CELL_AT(a, n-1), g);
+                NEXT;
+            }
+            RULE(C_SN)
+            { /* SN NUM(n) f g x1..xn -> f x1..xn (g x1..xn) */
+                int i, n = intof(ARG(1));
+                REQUIRE(n + 3);
+                Cell a = alloc(2 * n);
+                SET(a, ARG(2), ARG(4));
+                SET(CELL_AT(a, n), ARG(3), ARG(4));
+                for (i = 1; i < n; i++) {
+                    SET(CELL_AT(a, i), CELL_AT(a, i-1), ARG(4+i));
+                    SET(CELL_AT(a, n+i), CELL_AT(a, n+i-1), ARG(4+i));
+                }
+                DROP(n + 3);
+                SET(TOP, CELL_AT(a, n-1), CELL_AT(a, 2*n-1));
+                NEXT;
+            }
+            RULE(C_LAZY)
+            { /* LAZY t -> I t', t' being the translation of t */
+                REQUIRE(1);
+                POP;
+                Cell r = translate_term(cdr(TOP));
+                SET(TOP, COMB_I, r);
+                TOP = r;
+                vm->lazy_translations++;
+                NEXT;
+            }
+            RULE(C_JIT)
+            { /* JIT NUM(i) x1..xn -> what code i does (see COMPILED TERMS) */
+                JitCode *code = vm->jit_codes[intof(ARG(1))];
+                Cell a, holes[JIT_HOLES];
+                const Cell *op;
+                int i, n = code->arity;
+
+                if (!APPLICABLE(n + 1)) {
+                    POP;
+                    TOP = code->orig;
+                    continue;
+                }
+                PROFILE(C_JIT);
+                TRACE(C_JIT, PUSHED(1));
+                a = alloc(code->ncells);
+                for (i = 0; i < code->ncells; i++)
+                    holes[i] = CELL_AT(a, i);
+                for (i = 1; i <= n; i++) {
+                    holes[JIT_PUSHED_HOLE(i + 1)] = PUSHED(i + 1);
+                    holes[JIT_ARG_HOLE(i)] = ARG(i + 1);
+                }
+                op = code->ops;
+                for (i = 0; i < code->ncells; i++, op += 2)
+                    SET(holes[i], JIT_FILL(holes, op[0]), JIT_FILL(holes, op[1]));
+                for (i = 0; i < code->nupdates; i++, op += 3)
+                    SET(JIT_FILL(holes, op[0]), JIT_FILL(holes, op[1]),
+                        JIT_FILL(holes, op[2]));
+                DROP(n + 1);
+                TOP = JIT_FILL(holes, op[0]);
+                for (i = 1; i < code->nstack; i++)
+                    PUSH(JIT_FILL(holes, op[i]));
+                /* the last of the steps is counted at next, which
+                 * then sees check_at even if the steps jumped it */
+                vm->reductions += code->steps - 1;
+                vm->jit_reductions += code->steps;
+                NEXT;
+            }
+
+            END_RULES
+        }
+        else if (ischar(TOP) && APPLICABLE(2)) {
+            int c = charof(TOP);
+            if (c <= 0) {  /* CHAR(0) f z -> z */
+                PROFILE(P_CHAR_ZERO);
+                TRACE(P_CHAR_ZERO, PUSHED(1));
+                Cell z = ARG(2);
+                DROP(2);
+                SET(TOP, COMB_I, z);
+            }
+            else if (ARG(1) == COMB_INC && isint(ARG(2))) {
+                /* CHAR(n) INC NUM(m) -> NUM(m+n) */
+                PROFILE(P_CHAR_INC);
+                TRACE(P_CHAR_INC, PUSHED(1));
+                Cell m = ARG(2);
+                DROP(2);
+                SET(TOP, COMB_I, mkint(intof(m) + c));
+            }
+            else {       /* CHAR(n+1) f z -> f (CHAR(n) f z) */
+                PROFILE(P_CHAR_APPLY);
+                TRACE(P_CHAR_APPLY, PUSHED(1));
+                Cell a = alloc(2);
+                Cell f = ARG(1);
+                SET(CELL_AT(a, 0), mkchar(c-1), f);         /* CHAR(n) f */
+                SET(CELL_AT(a, 1), CELL_AT(a, 0), ARG(2));  /* CHAR(n) f z */
+                DROP(2);
+                SET(TOP, f, CELL_AT(a, 1));                 /* f (CHAR(n) f z) */
+            }
+        }
+        else if (isint(TOP) && APPLICABLE(1))
+            errexit("invalid output format (attempted to apply a number)\n");
+        else
+            goto done;
+        NEXT;
+
+    done:
+        /* TOP is the value of the current frame */
+        if (bottom == base)
+            return 0;
+        else {
+            Cell kind;
+            v = TOP;
+            vm->rd_stack.sp = bottom;
+            kind = POP;
+            bottom = STACK_TOP - intof(POP);
+
+            if (kind == FRAME_INC) {
+                PROFILE(P_INC_RESULT);
+                TRACE(P_INC_RESULT, TOP);
+                if (!isint(v))
+                    errexit("invalid output format (attempted to apply inc to a non-number)\n");
+                SET(TOP, COMB_I, mkint(intof(v) + 1));
+                NEXT;
+            }
+        }
+
+    put_result:
+        /* the number v has been computed for PUTC x y */
+        PROFILE(P_PUTC_RESULT);
+        TRACE(P_PUTC_RESULT, TOP);
+        if (!isint(v))
+            errexit("invalid output format (result was not a number)\n");
+        if (intof(v) >= 256)
+            errexit("invalid character %d\n", intof(v));
+
+        output_byte(intof(v));
+
+        SETCDR(PUSHED(1), cdr(TOP));        /* y */
+        POP;
+        SETCAR(TOP, COMB_WRITE);    /* WRITE y */
+
+    next:
+        if (++vm->reductions >= vm->check_at) {
+            if (vm->reductions >= vm->yield_at) {
+                vm->eval_bottom = bottom;
+                return CLAMB_YIELDED;
+            }
+            eval_check(bottom);
+        }
+    }
+}
+
+#if defined(CLAMB_PROFILE) || defined(CLAMB_TRACE)
+const char *rule_names[NUM_PROFILE] = {
+    [C_S] = "S", [C_K] = "K", [C_I] = "I", [C_B] = "B", [C_C] = "C",
+    [C_SP] = "S'", [C_BS] = "B*", [C_CP] = "C'", [C_IOTA] = "IOTA",
+    [C_KI] = "KI", [C_READ] = "READ", [C_WRITE] = "WRITE",
+    [C_INC] = "INC", [C_CONS] = "CONS", [C_PUTC] = "PUTC",
+    [C_RETURN] = "RETURN", [C_SUCC] = "SUCC", [C_SUCC2] = "SUCC2",
+    [C_PRED] = "PRED", [C_ISZERO] = "ISZERO", [C_ADD] = "ADD",
+    [C_SUB] = "SUB", [C_MUL] = "MUL", [C_BN] = "Bn", [C_CN] = "Cn",
+    [C_SN] = "Sn", [C_LAZY] = "LAZY", [C_JIT] = "JIT",
+    [P_CHAR_ZERO] = "CHAR(0)", [P_CHAR_INC] = "CHAR(n) INC",
+    [P_CHAR_APPLY] = "CHAR(n+1)", [P_INC_RESULT] = "INC result",
+    [P_PUTC_RESULT] = "PUTC result", [P_LOADER] = "(loader)",
+};
+#endif
+
+#ifdef CLAMB_PROFILE
+/* Prints the rules by number of reductions. */
+void profile_print(void)
+{
+    int order[NUM_PROFILE];
+    long total = 0;
+    int i, j;
+
+    for (i = 0; i < NUM_PROFILE; i++) {
+        total += vm->profile[i].count;
+        for (j = i; j > 0 &&
+                 vm->profile[order[j - 1]].count < vm->profile[i].count; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    printf("  rule           reductions        cells  cells/red.\n");
+    for (i = 0; i < NUM_PROFILE; i++) {
+        int r = order[i];
+        if (vm->profile[r].count == 0 && vm->profile[r].cells == 0)
+            continue;
+        printf("  %-12s %12ld %5.1f%% %12ld", rule_names[r],
+               vm->profile[r].count,
+               total ? 100.0 * vm->profile[r].count / total : 0.0,
+               vm->profile[r].cells);
+        if (vm->profile[r].count)
+            printf(" %6.2f", (double)vm->profile[r].cells / vm->profile[r].count);
+        putchar('\n');
+    }
+}
+#endif
+
+/* Pushes the application that evaluates root and prints its output. */
+void eval_start(Cell root)
+{
+    PUSH(pair(COMB_WRITE,
+              pair(root,
+                   pair(COMB_READ, NIL))));
+}
+
+/* Runs eval to the end, through any yields. */
+void eval_all(Cell *base, Cell *bottom)
+{
+    vm->yield_at = LLONG_MAX;
+    output_init();
+    while (eval(base, bottom) == CLAMB_YIELDED)
+        bottom = vm->eval_bottom;
+    output_sync();
+}
+
+void eval_print(Cell root)
+{
+    Cell *base = vm->rd_stack.sp;
+    eval_start(root);
+    eval_all(base, base);
+}
+
+/**********************************************************************
+ *  Krivine Machine
+ **********************************************************************/
+
+/* KRIVINE MACHINE
+ *
+ *  With -e kam, the parsed program is evaluated as it is, without the
+ *  translation to combinators, by a lazy Krivine machine (call by need,
+ *  as in Sestoft's mark 1). Its state is a closure, the term kam_term in
+ *  the environment kam_env, and rd_stack, which holds the arguments of
+ *  the closure and the frames below them. An environment is a list of
+ *  thunks, innermost variable first. A thunk is a cell (term, env) that
+ *  is overwritten with its value when it has been evaluated (KM_UPDATE),
+ *  so it is shared by all the environments it is in. All of them are
+ *  cells of the heap, allocated from the nursery and collected as the
+ *  graph is.
+ *
+ *  Besides lambdas, the values are the built-in functions of the I/O
+ *  protocol of eval_start: CHAR(n) for the bytes of the input, CONS and
+ *  KI for its list, INC, PUTC and RETURN. The environment of a built-in
+ *  holds the arguments it has been given so far, the last first. The
+ *  input is the thunk READ NIL, which evaluates to CONS with the next
+ *  byte and a new READ NIL. A variable beyond the environment is the
+ *  number that is left of its index, as the translation makes it NUM(n);
+ *  numbers are what INC makes of the Church numerals the output is made
+ *  of, with frames KM_INC and KM_PUTC waiting for them as in eval.
+ *  Reductions count the beta reductions and the built-ins applied.
+ */
+
+#define KT              (vm->kam_term)
+#define KE              (vm->kam_env)
+
+/* Returns the number of arguments built-in t takes. */
+int kam_arity(Cell t)
+{
+    if (ischar(t))
+        return 2;
+    switch (combof(t)) {
+    case C_INC:         return 1;
+    case C_KI:          return 2;
+    case C_PUTC:        return 2;
+    case C_CONS:        return 3;
+    default:            return 0;   /* READ, RETURN */
+    }
+}
+
+/* Whether the closure (t, e) is a value. */
+int kam_whnf(Cell t, Cell e)
+{
+    int n;
+
+    if (ispair(t))
+        return car(t) == LAMBDA;
+    if (isint(t))
+        return e == NIL;
+    for (n = 0; e != NIL; e = cdr(e))
+        n++;
+    return n < kam_arity(t);
+}
+
+/* Makes thunk th the current closure. */
+void kam_force(Cell th)
+{
+    KT = car(th);
+    KE = cdr(th);
+    if (!kam_whnf(KT, KE)) {
+        PUSH(th);
+        PUSH(KM_UPDATE);
+    }
+}
+
+/* Pushes the application that evaluates root and prints its output. */
+void kam_start(Cell root)
+{
+    KT = root;
+    KE = NIL;
+    PUSH(pair(COMB_RETURN, NIL));
+    PUSH(pair(COMB_PUTC, NIL));
+    PUSH(pair(COMB_READ, NIL));
+}
+
+int kam_eval(Cell *bottom)
+{
+    Cell th, e, a;
+    int n;
+
+    eval_schedule(0);
+    for (;;) {
+        if (ispair(KT) && car(KT) == LAMBDA) {
+            if (!APPLICABLE(0) || !ispair(TOP))
+                goto value;
+            KE = pair(TOP, KE);
+            POP;
+            KT = cdr(KT);
+            goto reduced;
+        }
+        if (ispair(KT)) {       /* application */
+            a = cdr(KT);
+            if (!isint(a))
+                th = pair(a, KE);
+            else {              /* no thunk for a variable */
+                for (n = intof(a), e = KE; n > 0 && e != NIL; n--)
+                    e = cdr(e);
+                th = e != NIL ? car(e) : pair(mkint(n), NIL);
+            }
+            PUSH(th);
+            KT = car(KT);
+            continue;
+        }
+        if (isint(KT)) {        /* variable */
+            for (n = intof(KT), e = KE; n > 0 && e != NIL; n--)
+                e = cdr(e);
+            if (e != NIL) {
+                kam_force(car(e));
+                continue;
+            }
+            KT = mkint(n);      /* a number */
+            KE = NIL;
+            if (APPLICABLE(0) && ispair(TOP))
+                errexit("invalid output format (attempted to apply a number)\n");
+            goto value;
+        }
+
+        if (KT == COMB_RETURN)
+            goto done;
+        if (KT == COMB_READ) {  /* READ NIL -> CONS CHAR(c) (READ NIL) */
+            int c = read_char();
+            if (c == EOF && vm->input.would_block) {
+                /* suspend; READ is evaluated again on resumption */
+                vm->input.would_block = 0;
+                vm->eval_bottom = bottom;
+                return CLAMB_BLOCKED;
+            }
+            if (c == EOF) {
+                KT = COMB_KI;
+                KE = NIL;
+            }
+            else {
+                a = alloc(4);
+                car(CELL_AT(a, 0)) = mkchar(c);
+                cdr(CELL_AT(a, 0)) = NIL;
+                car(CELL_AT(a, 1)) = COMB_READ;
+                cdr(CELL_AT(a, 1)) = NIL;
+                car(CELL_AT(a, 2)) = CELL_AT(a, 1);
+                cdr(CELL_AT(a, 2)) = CELL_AT(a, 3);
+                car(CELL_AT(a, 3)) = CELL_AT(a, 0);
+                cdr(CELL_AT(a, 3)) = NIL;
+                KT = COMB_CONS;
+                KE = CELL_AT(a, 2);
+            }
+            goto reduced;
+        }
+
+        /* a built-in: its arguments so far go back on the stack */
+        for (; KE != NIL; KE = cdr(KE))
+            PUSH(car(KE));
+        for (n = 0; n < kam_arity(KT) && APPLICABLE(n) && ispair(PUSHED(n)); n++)
+            ;
+        if (n < kam_arity(KT)) {
+            while (n-- > 0) {
+                KE = pair(TOP, KE);
+                POP;
+            }
+            goto value;
+        }
+        if (ischar(KT)) {
+            int c = charof(KT);
+            if (c == 0) {       /* CHAR(0) f z -> z */
+                th = PUSHED(1);
+                DROP(2);
+                kam_force(th);
+            }
+            else if (car(TOP) == COMB_INC && cdr(TOP) == NIL &&
+                     isint(car(PUSHED(1))) && cdr(PUSHED(1)) == NIL) {
+                /* CHAR(n) INC NUM(m) -> NUM(m+n) */
+                KT = mkint(intof(car(PUSHED(1))) + c);
+                DROP(2);
+            }
+            else {              /* CHAR(n+1) f z -> f (CHAR(n) f z) */
+                a = alloc(3);
+                car(CELL_AT(a, 0)) = mkchar(c - 1);
+                cdr(CELL_AT(a, 0)) = CELL_AT(a, 1);
+                car(CELL_AT(a, 1)) = PUSHED(1);
+                cdr(CELL_AT(a, 1)) = CELL_AT(a, 2);
+                car(CELL_AT(a, 2)) = TOP;
+                cdr(CELL_AT(a, 2)) = NIL;
+                th = TOP;
+                DROP(2);
+                PUSH(CELL_AT(a, 0));
+                kam_force(th);
+            }
+        }
+        else {
+            switch (combof(KT)) {
+            case C_KI:          /* KI x y -> y */
+                th = PUSHED(1);
+                DROP(2);
+                kam_force(th);
+                break;
+            case C_CONS:        /* CONS x y f -> f x y */
+                th = PUSHED(2);
+                PUSHED(2) = PUSHED(1);
+                PUSHED(1) = TOP;
+                POP;
+                kam_force(th);
+                break;
+            case C_INC:         /* INC x -> eval(x)+1 */
+                th = POP;
+                PUSH(KM_INC);
+                kam_force(th);
+                break;
+            case C_PUTC:        /* PUTC x y -> putc(eval(x INC NUM(0))); y PUTC RETURN */
+                a = alloc(2);
+                car(CELL_AT(a, 0)) = mkint(0);
+                cdr(CELL_AT(a, 0)) = NIL;
+                car(CELL_AT(a, 1)) = COMB_INC;
+                cdr(CELL_AT(a, 1)) = NIL;
+                th = TOP;
+                TOP = KM_PUTC;
+                PUSH(CELL_AT(a, 0));
+                PUSH(CELL_AT(a, 1));
+                kam_force(th);
+                break;
+            }
+        }
+        goto reduced;
+
+    value:
+        /* (KT, KE) is a value, and no argument is left for it */
+        if (!APPLICABLE(0))
+            goto done;
+        if (TOP == KM_UPDATE) {
+            POP;
+            th = POP;
+            SET(th, KT, KE);
+            continue;
+        }
+        if (TOP == KM_INC) {
+            if (!isint(KT))
+                errexit("invalid output format (attempted to apply inc to a non-number)\n");
+            POP;
+            KT = mkint(intof(KT) + 1);
+            goto reduced;
+        }
+        /* KM_PUTC */
+        if (!isint(KT))
+            errexit("invalid output format (result was not a number)\n");
+        if (intof(KT) >= 256)
+            errexit("invalid character %d\n", intof(KT));
+        output_byte(intof(KT));
+        a = alloc(2);
+        car(CELL_AT(a, 0)) = COMB_PUTC;
+        cdr(CELL_AT(a, 0)) = NIL;
+        car(CELL_AT(a, 1)) = COMB_RETURN;
+        cdr(CELL_AT(a, 1)) = NIL;
+        POP;
+        th = TOP;                               /* y */
+        TOP = CELL_AT(a, 1);
+        PUSH(CELL_AT(a, 0));
+        kam_force(th);                          /* y PUTC RETURN */
+
+    reduced:
+        if (++vm->reductions >= vm->check_at) {
+            if (vm->reductions >= vm->yield_at) {
+                vm->eval_bottom = bottom;
+                return CLAMB_YIELDED;
+            }
+            eval_check(NULL);
+        }
+    }
+
+  done:
+    KT = KE = NIL;
+    return 0;
+}
+
+/* Runs the program to the end with the Krivine machine. */
+void kam_print(Cell root)
+{
+    Cell *bottom = vm->rd_stack.sp;
+
+    kam_start(root);
+    vm->yield_at = LLONG_MAX;
+    output_init();
+    while (kam_eval(bottom) == CLAMB_YIELDED)
+        ;
+    output_sync();
+}
+
+/**********************************************************************
+ *  Library Interface
+ **********************************************************************/
+
+const char *advice_names[] = { "none", "dontneed", "free", NULL };
+const char *flush_names[] = { "auto", "size", "line", "byte", NULL };
+const char *engine_names[] = { "graph", "kam", NULL };
+
+/* parameters that can be set with -X name=value, clamb_option or (for
+ * the command) the environment variable CLAMB_NAME */
+enum {
+    T_INT,      /* a non-negative number */
+    T_SIZE,     /* bytes with an optional K, M or G suffix, stored as cells */
+    T_CHOICE,   /* one of names, stored as its index */
+};
+struct {
+    const char *name;
+    size_t offset;              /* of the int in Clamb */
+    int kind;
+    const char **names;
+} tunables[] = {
+    { "copy-depth", offsetof(Clamb, copy_depth), T_INT, NULL },
+    { "madvise", offsetof(Clamb, dead_space_advice), T_CHOICE, advice_names },
+    { "heap-initial", offsetof(Clamb, heap_initial), T_SIZE, NULL },
+    { "heap-max", offsetof(Clamb, heap_max), T_SIZE, NULL },
+    { "gc-target", offsetof(Clamb, gc_target), T_INT, NULL },
+    { "gc-threads", offsetof(Clamb, gc_threads), T_INT, NULL },
+    { "quantum", offsetof(Clamb, quantum), T_INT, NULL },
+    { "kiselyov", offsetof(Clamb, kiselyov_mode), T_INT, NULL },
+    { "share", offsetof(Clamb, share_mode), T_INT, NULL },
+    { "lazy", offsetof(Clamb, lazy_mode), T_INT, NULL },
+    { "jit", offsetof(Clamb, jit_threshold), T_INT, NULL },
+    { "flush", offsetof(Clamb, flush_policy), T_CHOICE, flush_names },
+    { "flush-size", offsetof(Clamb, flush_size), T_INT, NULL },
+    { "flush-delay", offsetof(Clamb, flush_delay), T_INT, NULL },
+    { "output-thread", offsetof(Clamb, output_thread), T_INT, NULL },
+    { "engine", offsetof(Clamb, engine), T_CHOICE, engine_names },
+};
+#define NUM_TUNABLES    (int)(sizeof(tunables) / sizeof(tunables[0]))
+#define TUNABLE(i)      (*(int *)((char *)vm + tunables[i].offset))
+
+/* Sets tunables[i] to value; what names the setting in error messages. */
+void parse_tunable(int i, const char *value, const char *what)
+{
+    char *end;
+    long long n;
+
+    if (tunables[i].kind == T_CHOICE) {
+        for (n = 0; tunables[i].names[n]; n++) {
+            if (strcmp(value, tunables[i].names[n]) == 0) {
+                TUNABLE(i) = n;
+                return;
+            }
+        }
+        errexit("invalid value for %s\n", what);
+    }
+    errno = 0;
+    n = strtoll(value, &end, 10);
+    if (end == value || n < 0 || errno == ERANGE)
+        errexit("invalid value for %s\n", what);
+    if (tunables[i].kind == T_SIZE) {
+        long long unit = 1;
+        switch (*end) {
+        case 'G': case 'g': unit *= 1024;  /* fall through */
+        case 'M': case 'm': unit *= 1024;  /* fall through */
+        case 'K': case 'k': unit *= 1024; end++;
+        }
+        if (n > INT32_MAX * (long long)sizeof(Pair) / unit)
+            errexit("invalid value for %s\n", what);
+        n = n * unit / sizeof(Pair);
+    }
+    if (*end != '\0' || n > INT32_MAX)
+        errexit("invalid value for %s\n", what);
+    TUNABLE(i) = n;
+}
+
+void set_tunable(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    char what[64];
+    int i;
+
+    for (i = 0; i < NUM_TUNABLES; i++) {
+        if (eq && strncmp(arg, tunables[i].name, eq - arg) == 0 &&
+            tunables[i].name[eq - arg] == '\0') {
+            snprintf(what, sizeof(what), "-X %s", tunables[i].name);
+            parse_tunable(i, eq + 1, what);
+            return;
+        }
+    }
+    errexit("unknown parameter '%s' for -X\n", arg);
+}
+
+Clamb *clamb_new(void)
+{
+    Clamb *ctx = calloc(1, sizeof(Clamb));
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->copy_depth = 16;
+    ctx->dead_space_advice = ADVISE_NONE;
+    ctx->heap_initial = INITIAL_HEAP_SIZE;
+    ctx->gc_target = 5;
+    ctx->gc_threads = 1;
+    ctx->quantum = 100000;
+    ctx->flush_size = 4096;
+    ctx->kam_term = ctx->kam_env = NIL;
+    ctx->verbosity = V_NONE;
+#ifdef CLAMB_PROFILE
+    ctx->profile_rule = P_LOADER;
+#endif
+    return ctx;
+}
+
+Clamb *clamb_clone(const Clamb *from)
+{
+    Clamb *ctx = clamb_new();
+    int i;
+
+    if (ctx == NULL)
+        return NULL;
+    for (i = 0; i < NUM_TUNABLES; i++)
+        *(int *)((char *)ctx + tunables[i].offset) =
+            *(const int *)((const char *)from + tunables[i].offset);
+    ctx->verbosity = from->verbosity;
+    if ((ctx->template = from->template) != NULL)
+        __atomic_add_fetch(&ctx->template->refs, 1, __ATOMIC_RELAXED);
+    ctx->input.read_fn = from->input.read_fn;
+    ctx->input.read_arg = from->input.read_arg;
+    ctx->write_fn = from->write_fn;
+    ctx->write_arg = from->write_arg;
+    return ctx;
+}
+
+void template_release(Template *t)
+{
+    if (t && __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(t);
+}
+
+void clamb_free(Clamb *ctx)
+{
+    int i;
+
+    vm = ctx;
+    if (ctx->gc_workers) {
+        ctx->gc_shutdown = 1;
+        pthread_barrier_wait(&ctx->gc_start_barrier);
+        for (i = 1; i < ctx->gc_pool; i++)
+            pthread_join(ctx->gc_workers[i].thread, NULL);
+        for (i = 0; i < ctx->gc_pool; i++)
+            free(ctx->gc_workers[i].overflow);
+        free(ctx->gc_workers);
+        pthread_barrier_destroy(&ctx->gc_start_barrier);
+        pthread_barrier_destroy(&ctx->gc_end_barrier);
+    }
+    if (ctx->arena_map)
+        munmap(ctx->arena_map, ctx->arena_map_size);
+    if (ctx->rd_stack.stack)
+        munmap(ctx->rd_stack.stack, sizeof(Cell) * RDSTACK_SIZE);
+    if (ctx->image_map)
+        munmap(ctx->image_map, ctx->image_map_size);
+    input_close();
+    output_stop();
+#ifdef CLAMB_TRACE
+    trace_close();
+#endif
+    jit_free();
+    free(ctx->jit_codes);
+    free(ctx->jit_samples);
+    free(ctx->remembered);
+    free(ctx->mask_stack);
+    template_release(ctx->template);
+    free(ctx);
+    vm = NULL;
+}
+
+/* Makes ctx the current context and catches errors at jmp (which the
+ * caller must setjmp right after). */
+#define ENTER(ctx, jmp) \
+    (vm = (ctx), vm->error_jmp = &(jmp), vm->error_thread = pthread_self())
+#define LEAVE()         (vm->error_jmp = NULL)
+
+int clamb_option(Clamb *ctx, const char *option)
+{
+    jmp_buf jmp;
+
+    ENTER(ctx, jmp);
+    if (setjmp(jmp)) {
+        LEAVE();
+        return -1;
+    }
+    set_tunable(option);
+    LEAVE();
+    return 0;
+}
+
+void clamb_set_input(Clamb *ctx, ClambReadFn fn, void *arg)
+{
+    ctx->input.read_fn = fn;
+    ctx->input.read_arg = arg;
+}
+
+void clamb_set_output(Clamb *ctx, ClambWriteFn fn, void *arg)
+{
+    ctx->write_fn = fn;
+    ctx->write_arg = arg;
+}
+
+/* A loaded program is kept outside the heap as a template: its cells,
+ * compacted by a full collection and encoded as in program images. Each
+ * run starts from an empty heap holding a fresh copy of the template, so
+ * runs do not see each other's reductions and garbage. The template is
+ * never written after it is made, and clones of the context share it. */
+
+void template_make(Cell root)
+{
+    int i, n = gc_full(&root);
+    Pair *cells = vm->old_area;
+    Template *t = malloc(sizeof(Template) + sizeof(Pair) * n);
+
+    if (t == NULL)
+        errexit("Cannot allocate program template (%d cells)\n", n);
+    for (i = 0; i < n; i++) {
+        t->cells[i].car = image_encode(cells[i].car, cells);
+        t->cells[i].cdr = image_encode(cells[i].cdr, cells);
+    }
+    t->refs = 1;
+    t->size = n;
+    t->engine = vm->engine;
+    t->root = image_encode(root, cells);
+    vm->template = t;
+}
+
+/* Empties the heap, copies the template to the start of the old
+ * generation and returns its root. */
+Cell template_copy(void)
+{
+    Template *t = vm->template;
+    Pair *cells = vm->old_area;
+    int i, n = t->size;
+
+    jit_free();
+    vm->kam_term = vm->kam_env = NIL;
+    vm->free_ptr = vm->nursery;
+    vm->num_remembered = 0;
+    vm->minor_gc = 0;
+    vm->heap_size = vm->old_end - vm->old_area;
+    if (vm->heap_size < n + 2 * NURSERY_SIZE) {
+        if (n + 2 * NURSERY_SIZE > vm->heap_max)
+            errexit("heap exhausted (%d live cells, heap-max is %d cells)\n",
+                    n, vm->heap_max);
+        vm->heap_size = n + 2 * NURSERY_SIZE;
+        vm->old_end = vm->old_area + vm->heap_size;
+        if (vm->next_heap_size < vm->heap_size)
+            vm->next_heap_size = vm->heap_size;
+    }
+    for (i = 0; i < n; i++) {
+        cells[i].car = image_decode(t->cells[i].car, cells);
+        cells[i].cdr = image_decode(t->cells[i].cdr, cells);
+    }
+    vm->old_ptr = cells + n;
+    vm->last_major_alive = n;
+    return image_decode(t->root, cells);
+}
+
+/* Allocates the heap and the stack at the first use of the context. */
+void vm_init(void)
+{
+    if (vm->arena_map == NULL) {
+        storage_init(vm->heap_initial);
+        rs_init();
+    }
+}
+
+/* Empties the heap and the stack for a new program. */
+void vm_reset(void)
+{
+    vm_init();
+    if (vm->image_map) {
+        munmap(vm->image_map, vm->image_map_size);
+        vm->image_map = NULL;
+    }
+    vm->free_ptr = vm->nursery;
+    vm->old_ptr = vm->old_area;
+    vm->heap_size = vm->old_end - vm->old_area;
+    vm->last_major_alive = 0;
+    vm->num_remembered = 0;
+    vm->minor_gc = 0;
+    vm->rd_stack.sp = vm->rd_stack.low = STACK_TOP;
+    vm->eval_bottom = NULL;
+    vm->kam_term = vm->kam_env = NIL;
+    vm->mask_sp = 0;
+    template_release(vm->template);
+    vm->template = NULL;
+    vm->out_len = 0;
+    vm->reductions = vm->num_minor_gc = vm->num_major_gc = 0;
+    vm->lazy_translations = 0;
+    vm->jit_compiled = vm->jit_reductions = 0;
+    jit_free();
+    PROFILE_RESET();
+    vm->total_gc_time = vm->max_gc_pause = 0.0;
+    memset(vm->gc_pauses, 0, sizeof(vm->gc_pauses));
+    vm->allocated = vm->promoted = 0;
+    vm->major_scanned = vm->major_alive = 0;
+    vm->parse_time = vm->translate_time = 0.0;
+    vm->max_heap_size = vm->max_alive = 0;
+}
+
+int clamb_load(Clamb *ctx, const void *buf, size_t size)
+{
+    unsigned char *copy;
+    jmp_buf jmp;
+    Cell root;
+
+    ENTER(ctx, jmp);
+    if (setjmp(jmp)) {
+        template_release(vm->template);
+        vm->template = NULL;
+        vm->rd_stack.sp = STACK_TOP;
+        LEAVE();
+        return -1;
     }
+    vm_reset();
+    input_close();
+    input_init(NULL);
+    copy = malloc(size ? size : 1);
+    if (copy == NULL)
+        errexit("Cannot allocate %lu bytes\n", (unsigned long)size);
+    memcpy(copy, buf, size);
+    input_unread(copy, size);
+
+    root = load_program();
+    if (vm->share_mode)
+        root = share(root, gc_full(&root));
+    template_make(root);
+    LEAVE();
+    return 0;
 }
 
-Cell load_program(void)
+/* Ends the current run; the next one reads its own input. */
+void run_end(void)
 {
-    return translate(parse());
+    vm->eval_bottom = NULL;
+    vm->rd_stack.sp = STACK_TOP;
+    input_close();
+    input_init(NULL);
 }
 
-void unparse(Cell e)
+int clamb_step(Clamb *ctx)
 {
-    if (ispair(e)) {
-        putchar('`');
-        unparse(car(e));
-        unparse(cdr(e));
+    jmp_buf jmp;
+    Cell root;
+    int status;
+
+    if (ctx->template == NULL) {
+        snprintf(ctx->error, sizeof(ctx->error), "no program is loaded");
+        return -1;
     }
-    else if (e == COMB_S) putchar('S');
-    else if (e == COMB_K) putchar('K');
-    else if (e == COMB_I) putchar('I');
-    else if (e == COMB_B) putchar('B');
-    else if (e == COMB_C) putchar('C');
-    else if (e == COMB_SP) printf("S'");
-    else if (e == COMB_BS) printf("B*");
-    else if (e == COMB_CP) printf("C'");
-    else if (e == COMB_KI) printf("`ki");
-    else putchar('?');
+    ENTER(ctx, jmp);
+    if (setjmp(jmp)) {
+        output_flush();         /* out_len is 0 if this fails again */
+        run_end();
+        LEAVE();
+        return -1;
+    }
+    if (vm->eval_bottom == NULL) {
+        vm_init();
+        vm->reductions = vm->jit_reductions = vm->jit_compiled = 0;
+        vm->rd_stack.sp = STACK_TOP;
+        root = template_copy();
+#ifdef CLAMB_TRACE
+        if (vm->trace_file)
+            trace_run(root, vm->old_area, vm->template->size);
+#endif
+        if (vm->template->engine == ENGINE_KAM)
+            kam_start(root);
+        else
+            eval_start(root);
+        vm->eval_bottom = STACK_TOP;
+    }
+    vm->yield_at = vm->quantum > 0 ? vm->reductions + vm->quantum : LLONG_MAX;
+    output_init();
+    if (vm->template->engine == ENGINE_KAM)
+        status = kam_eval(vm->eval_bottom);
+    else
+        status = eval(STACK_TOP, vm->eval_bottom);
+    output_sync();
+    if (status == 0)
+        run_end();
+    LEAVE();
+    return status;
+}
+
+int clamb_run(Clamb *ctx)
+{
+    int quantum = ctx->quantum, status;
+
+    ctx->quantum = 0;
+    do
+        status = clamb_step(ctx);
+    while (status == CLAMB_YIELDED);
+    ctx->quantum = quantum;
+    return status;
 }
 
+const char *clamb_error(const Clamb *ctx)
+{
+    return ctx->error;
+}
+
+void clamb_get_stats(const Clamb *ctx, ClambStats *stats)
+{
+    stats->reductions = ctx->reductions;
+    stats->minor_gc = ctx->num_minor_gc;
+    stats->major_gc = ctx->num_major_gc;
+    stats->gc_time = ctx->total_gc_time;
+    stats->max_gc_pause = ctx->max_gc_pause;
+    stats->max_stack_depth = ctx->rd_stack.stack ?
+        ctx->rd_stack.stack + RDSTACK_SIZE - ctx->rd_stack.low : 0;
+    stats->heap_size = ctx->heap_size;
+    stats->max_heap_size = ctx->heap_size > ctx->max_heap_size ?
+        ctx->heap_size : ctx->max_heap_size;
+    stats->max_live_cells = ctx->max_alive;
+    stats->gc_pause_p50 = gc_pause_quantile(ctx, 0.5);
+    stats->gc_pause_p99 = gc_pause_quantile(ctx, 0.99);
+    stats->allocated_cells = ctx->allocated +
+        (ctx->nursery ? ctx->free_ptr - ctx->nursery : 0);
+    stats->promoted_cells = ctx->promoted;
+}
+
+#ifndef CLAMB_LIBRARY
+
 /**********************************************************************
- *  Reducer
+ *  Main
  **********************************************************************/
 
-int reductions;
-
-void eval(Cell root)
+/* Reads the CLAMB_* environment variables; -X options override them. */
+void getenv_tunables(void)
 {
-    Cell *bottom = rd_stack.sp;
-    PUSH(root);
+    char var[64], *p;
+    const char *value;
+    int i;
 
-    for (;;) {
-        while (ispair(TOP))
-            PUSH(car(TOP));
+    for (i = 0; i < NUM_TUNABLES; i++) {
+        snprintf(var, sizeof(var), "CLAMB_%s", tunables[i].name);
+        for (p = var; *p; p++)
+            *p = *p == '-' ? '_' : toupper((unsigned char)*p);
+        if ((value = getenv(var)) != NULL)
+            parse_tunable(i, value, var);
+    }
+}
 
-        if (TOP == COMB_I && APPLICABLE(1))
-        { /* I x -> x */
-            POP;
-            TOP = cdr(TOP);
-        }
-        else if (TOP == COMB_S && APPLICABLE(3))
-        { /* S f g x -> f x (g x) */
-            Cell a = alloc(2);
-            SET(a+0, ARG(1), ARG(3));   /* f x */
-            SET(a+1, ARG(2), ARG(3));   /* g x */
-            DROP(3);
-            SET(TOP, a+0, a+1); /* f x (g x) */
-        }
-        else if (TOP == COMB_K && APPLICABLE(2))
-        { /* K x y -> I x */
-            Cell x = ARG(1);
-            DROP(2);
-            SET(TOP, COMB_I, x);
-            TOP = cdr(TOP);     /* shortcut reduction of I */
-        }
-        else if (TOP == COMB_B && APPLICABLE(3))
-        { /* B f g x -> f (g x) */
-            Cell f, gx;
-            gx = pair(ARG(2), ARG(3));
-            f = ARG(1);
-            DROP(3);
-            SET(TOP, f, gx);
-        }
-        else if (TOP == COMB_C && APPLICABLE(3))
-        { /* C f g x -> f x g */
-            Cell fx, g;
-            fx = pair(ARG(1), ARG(3));
-            g = ARG(2);
-            DROP(3);
-            SET(TOP, fx, g);
-        }
-        else if (TOP == COMB_SP && APPLICABLE(4))
-        { /* SP c f g x -> c (f x) (g x) */
-            Cell a = alloc(3);
-            SET(a+0, ARG(2), ARG(4));   /* f x */
-            SET(a+1, ARG(3), ARG(4));   /* g x */
-            SET(a+2, ARG(1), a+0);      /* c (f x) */
-            DROP(4);
-            SET(TOP, a+2, a+1);         /* c (f x) (g x) */
-        }
-        else if (TOP == COMB_BS && APPLICABLE(4))
-        { /* BS c f g x -> c (f (g x)) */
-            Cell a, c;
-            a = alloc(2);
-            SET(a+0, ARG(3), ARG(4));   /* g x */
-            SET(a+1, ARG(2), a+0);      /* f (g x) */
-            c = ARG(1);
-            DROP(4);
-            SET(TOP, c, a+1);           /* c (f (g x)) */
-        }
-        else if (TOP == COMB_CP && APPLICABLE(4))
-        { /* BS c f g x -> c (f x) g */
-            Cell a, g;
-            a = alloc(2);
-            SET(a+0, ARG(2), ARG(4));   /* f x */
-            SET(a+1, ARG(1), a+0);      /* c (f x) */
-            g = ARG(3);
-            DROP(4);
-            SET(TOP, a+1, g);           /* c (f x) g */
+/* Batch mode reads records from files, or NUL-delimited from stdin.
+ * Each record is the input of one run of the program, which is loaded
+ * only once; the output of each run is followed by a NUL. */
+
+typedef struct {
+    int fd;
+    int eor, eof;               /* at the end of the record / the input */
+    int error;
+    int delimited;              /* records end at NUL bytes */
+    unsigned char buf[INPUT_BUFSIZE];
+    int pos, len;
+} RecordReader;
+
+/* Returns 0 at the end of the input. */
+int record_fill(RecordReader *r)
+{
+    while (r->pos == r->len && !r->eof) {
+        ssize_t n = read(r->fd, r->buf, sizeof(r->buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            r->eof = 1;
+            r->error = n < 0;
+            break;
         }
-        else if (TOP == COMB_IOTA && APPLICABLE(1))
-        { /* IOTA x -> x S K */
-            Cell xs = pair(ARG(1), COMB_S);
-            POP;
-            SET(TOP, xs, COMB_K);
-        }
-        else if (TOP == COMB_KI && APPLICABLE(2))
-        { /* KI x y -> I y */
-            DROP(2);
-            car(TOP) = COMB_I;
-        }
-        else if (TOP == COMB_CONS && APPLICABLE(3))
-        { /* CONS x y f -> f x y */
-            Cell fx, y;
-            fx = pair(ARG(3), ARG(1));
-            y = ARG(2);
-            DROP(3);
-            SET(TOP, fx, y);
-        }
-        else if (TOP == COMB_READ && APPLICABLE(2))
-        { /* READ NIL f -> CONS CHAR(c) (READ NIL) f
-                        -> I KI f */
-            int c = read_char();
-            if (c == EOF) {
-                POP;
-                SET(TOP, COMB_I, COMB_KI);
-            }
-            else {
-                Cell a = alloc(2);
-                SET(a+0, COMB_CONS, mkchar(c == EOF ? 256 : c));
-                SET(a+1, COMB_READ, NIL);
-                POP;
-                SET(TOP, a+0, a+1);
-            }
+        r->pos = 0;
+        r->len = n;
+    }
+    return r->pos < r->len;
+}
+
+int record_read(void *arg, unsigned char *buf, int size)
+{
+    RecordReader *r = arg;
+    unsigned char *p, *end;
+    int n;
+
+    if (r->eor)
+        return 0;
+    if (!record_fill(r))
+        return r->error ? -1 : 0;
+    p = r->buf + r->pos;
+    end = r->buf + r->len;
+    if (end - p > size)
+        end = p + size;
+    if (r->delimited) {
+        unsigned char *nul = memchr(p, '\0', end - p);
+        if (nul) {
+            end = nul;
+            r->eor = 1;
         }
-        else if (TOP == COMB_WRITE && APPLICABLE(1))
-        { /* WRITE x -> x PUTC RETURN */
-            POP;
-            Cell a = pair(cdr(TOP), COMB_PUTC); /* x PUTC */
-            SET(TOP, a, COMB_RETURN);           /* x PUTC RETURN */
-        }
-        else if (TOP == COMB_PUTC && APPLICABLE(3))
-        { /* PUTC x y i -> putc(eval(x INC NUM(0))); WRITE y */
-            Cell a = alloc(2);
-            SET(a+0, ARG(1), COMB_INC); /* x INC */
-            SET(a+1, a+0, mkint(0));    /* x INC NUM(0) */
-            DROP(2);
-            eval(a+1);
-
-            if (!isint(TOP))
-                errexit("invalid output format (result was not a number)\n");
-            if (intof(TOP) >= 256)
-                errexit("invalid character %d\n", intof(TOP));
-
-            putchar(intof(TOP));
-            POP;
+    }
+    n = end - p;
+    memcpy(buf, p, n);
+    r->pos += n + r->eor;
+    return n;
+}
 
-            ARG(1) = cdr(TOP);  /* y */
-            POP;
-            car(TOP) = COMB_WRITE;      /* WRITE y */
+/* Skips the rest of the current record, which the program did not read. */
+void record_skip(RecordReader *r)
+{
+    while (!r->eor && record_fill(r)) {
+        unsigned char *p = r->buf + r->pos;
+        unsigned char *nul = memchr(p, '\0', r->len - r->pos);
+        if (nul) {
+            r->pos = nul - r->buf + 1;
+            r->eor = 1;
+        } else
+            r->pos = r->len;
+    }
+}
+
+int run_record(RecordReader *r, const char *name)
+{
+    clamb_set_input(vm, record_read, r);
+    if (clamb_run(vm) < 0) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %s\n", name, clamb_error(vm));
+        return -1;
+    }
+    putchar('\0');
+    fflush(stdout);
+    return 0;
+}
+
+/* With -j, the records are jobs for a pool of threads, each running the
+ * program in its own clone of the context. A thread takes jobs from the
+ * front of its own range of records and, when that is empty, steals the
+ * back half of the range of another, so that a few long jobs do not hold
+ * up the rest. The outputs are buffered and written in record order. */
+
+typedef struct {
+    const char *name;           /* record file, or NULL for a stdin record */
+    const unsigned char *data;  /* unread part of a stdin record */
+    size_t size;
+    unsigned char *out;
+    size_t out_len, out_size;
+    char *error;                /* NULL if the run succeeded */
+    long reductions;
+    int done;
+} Job;
+
+typedef struct JobRunner JobRunner;
+
+typedef struct {
+    pthread_t thread;
+    JobRunner *runner;
+    Clamb *ctx;
+    RecordReader reader;
+    pthread_mutex_t lock;
+    int next, end;              /* the jobs not taken yet */
+} JobWorker;
+
+struct JobRunner {
+    Job *jobs;
+    int num_jobs;
+    JobWorker *workers;
+    int num_workers;
+    pthread_mutex_t out_lock;
+    int next_out;               /* the first job whose output is pending */
+    int failed;
+};
+
+int job_read(void *arg, unsigned char *buf, int size)
+{
+    Job *job = arg;
+    int n = job->size < (size_t)size ? (int)job->size : size;
+
+    memcpy(buf, job->data, n);
+    job->data += n;
+    job->size -= n;
+    return n;
+}
+
+int job_write(void *arg, const unsigned char *buf, int size)
+{
+    Job *job = arg;
+
+    if (job->out_len + size > job->out_size) {
+        size_t n = job->out_size ? job->out_size : OUTPUT_BUFSIZE;
+        unsigned char *out;
+        while (n < job->out_len + size)
+            n *= 2;
+        if ((out = realloc(job->out, n)) == NULL)
+            return -1;
+        job->out = out;
+        job->out_size = n;
+    }
+    memcpy(job->out + job->out_len, buf, size);
+    job->out_len += size;
+    return 0;
+}
+
+/* Returns the index of the next job for w, or -1 when all are taken. */
+int job_take(JobWorker *w)
+{
+    JobRunner *runner = w->runner;
+    int i, id = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->next < w->end)
+        id = w->next++;
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 1; id < 0 && i < runner->num_workers; i++) {
+        JobWorker *victim =
+            &runner->workers[(w - runner->workers + i) % runner->num_workers];
+        int mid, end;
+
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        mid = victim->next + (end - victim->next) / 2;
+        if (victim->next < end)
+            victim->end = mid;
+        pthread_mutex_unlock(&victim->lock);
+        if (mid < end) {
+            pthread_mutex_lock(&w->lock);
+            w->next = mid + 1;
+            w->end = end;
+            pthread_mutex_unlock(&w->lock);
+            id = mid;
         }
-        else if (TOP == COMB_RETURN)
+    }
+    return id;
+}
+
+void job_run(JobWorker *w, Job *job, int id)
+{
+    Clamb *ctx = w->ctx;
+    char msg[sizeof(ctx->error) + 64];
+
+    clamb_set_output(ctx, job_write, job);
+    if (job->name) {
+        memset(&w->reader, 0, sizeof(RecordReader));
+        if ((w->reader.fd = open(job->name, O_RDONLY)) < 0) {
+            snprintf(msg, sizeof(msg), "cannot open %s", job->name);
+            job->error = strdup(msg);
             return;
-        else if (TOP == COMB_INC && APPLICABLE(1))
-        { /* INC x -> eval(x)+1 */
-            Cell c = ARG(1);
-            POP;
-            eval(c);
+        }
+        clamb_set_input(ctx, record_read, &w->reader);
+    } else
+        clamb_set_input(ctx, job_read, job);
 
-            c = POP;
-            if (!isint(c))
-                errexit("invalid output format (attempted to apply inc to a non-number)\n");
-            SET(TOP, COMB_I, mkint(intof(c) + 1));
+    if (clamb_run(ctx) < 0) {
+        if (job->name)
+            snprintf(msg, sizeof(msg), "%s: %s", job->name, clamb_error(ctx));
+        else
+            snprintf(msg, sizeof(msg), "record %d: %s", id + 1,
+                     clamb_error(ctx));
+        job->error = strdup(msg);
+    }
+    job->reductions = ctx->reductions;
+    if (job->name)
+        close(w->reader.fd);
+}
+
+/* Marks a job as done and writes the outputs that are now in order. */
+void job_finish(JobRunner *runner, int id)
+{
+    pthread_mutex_lock(&runner->out_lock);
+    runner->jobs[id].done = 1;
+    while (runner->next_out < runner->num_jobs &&
+           runner->jobs[runner->next_out].done) {
+        Job *job = &runner->jobs[runner->next_out++];
+        fwrite(job->out, 1, job->out_len, stdout);
+        if (job->error) {
+            fflush(stdout);
+            fprintf(stderr, "%s\n", job->error);
+            runner->failed++;
+        } else
+            putchar('\0');
+        fflush(stdout);
+        free(job->out);
+        free(job->error);
+        job->out = NULL;
+        job->error = NULL;
+    }
+    pthread_mutex_unlock(&runner->out_lock);
+}
+
+void *job_worker(void *arg)
+{
+    JobWorker *w = arg;
+    int id;
+
+    while ((id = job_take(w)) >= 0) {
+        job_run(w, &w->runner->jobs[id], id);
+        job_finish(w->runner, id);
+    }
+    return NULL;
+}
+
+/* Splits stdin into jobs at NUL bytes. The data stays allocated. */
+Job *stdin_jobs(int *num_jobs)
+{
+    unsigned char *buf = NULL, *p, *end, *nul;
+    size_t len = 0, size = 0;
+    Job *jobs = NULL;
+    int n = 0;
+
+    for (;;) {
+        ssize_t r;
+        if (len == size) {
+            size = size ? size * 2 : INPUT_BUFSIZE;
+            if ((buf = realloc(buf, size)) == NULL)
+                errexit("Cannot allocate %lu bytes for records\n",
+                        (unsigned long)size);
         }
-        else if (ischar(TOP) && APPLICABLE(2)) {
-            int c = charof(TOP);
-            if (c <= 0) {  /* CHAR(0) f z -> z */
-                Cell z = ARG(2);
-                DROP(2);
-                SET(TOP, COMB_I, z);
-            }
-            else {       /* CHAR(n+1) f z -> f (CHAR(n) f z) */
-                Cell a = alloc(2);
-                Cell f = ARG(1);
-                SET(a+0, mkchar(c-1), f);       /* CHAR(n) f */
-                SET(a+1, a+0, ARG(2));          /* CHAR(n) f z */
-                DROP(2);
-                SET(TOP, f, a+1);               /* f (CHAR(n) f z) */
+        r = read(0, buf + len, size - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            errexit("read error: %s\n", strerror(errno));
+        if (r == 0)
+            break;
+        len += r;
+    }
+    for (p = buf, end = buf + len; p < end; p = nul + 1, n++) {
+        if ((nul = memchr(p, '\0', end - p)) == NULL)
+            nul = end;
+        if ((n & (n - 1)) == 0 &&
+            (jobs = realloc(jobs, sizeof(Job) * (n ? 2 * n : 1))) == NULL)
+            errexit("Cannot allocate %d jobs\n", n);
+        memset(&jobs[n], 0, sizeof(Job));
+        jobs[n].data = p;
+        jobs[n].size = nul - p;
+    }
+    *num_jobs = n;
+    return jobs;
+}
+
+int run_jobs(char **files, int num_threads)
+{
+    JobRunner runner;
+    Clamb *ctx = vm;
+    double start = wall_clock();
+    long reductions = 0;
+    int i, minor_gc = 0, major_gc = 0;
+    char *trace_file = ctx->trace_file;
+
+    memset(&runner, 0, sizeof(runner));
+    if (*files) {
+        for (; files[runner.num_jobs]; runner.num_jobs++)
+            ;
+        if ((runner.jobs = calloc(runner.num_jobs, sizeof(Job))) == NULL)
+            errexit("Cannot allocate %d jobs\n", runner.num_jobs);
+        for (i = 0; i < runner.num_jobs; i++)
+            runner.jobs[i].name = files[i];
+    } else
+        runner.jobs = stdin_jobs(&runner.num_jobs);
+
+    runner.num_workers = num_threads;
+    runner.workers = calloc(num_threads, sizeof(JobWorker));
+    if (runner.workers == NULL)
+        errexit("Cannot allocate %d job workers\n", num_threads);
+    pthread_mutex_init(&runner.out_lock, NULL);
+    for (i = 0; i < num_threads; i++) {
+        JobWorker *w = &runner.workers[i];
+        w->runner = &runner;
+        w->ctx = i == 0 ? ctx : clamb_clone(ctx);
+        if (w->ctx == NULL)
+            errexit("Cannot allocate interpreter state\n");
+        if (trace_file) {
+            /* each thread traces to FILE.N */
+            size_t len = strlen(trace_file) + 16;
+            if ((w->ctx->trace_file = malloc(len)) == NULL)
+                errexit("Cannot allocate trace file name\n");
+            snprintf(w->ctx->trace_file, len, "%s.%d", trace_file, i);
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        w->next = (long)runner.num_jobs * i / num_threads;
+        w->end = (long)runner.num_jobs * (i + 1) / num_threads;
+    }
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&runner.workers[i].thread, NULL, job_worker,
+                           &runner.workers[i]) != 0)
+            errexit("Cannot create job thread\n");
+    }
+    job_worker(&runner.workers[0]);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(runner.workers[i].thread, NULL);
+
+    for (i = 0; i < runner.num_jobs; i++)
+        reductions += runner.jobs[i].reductions;
+    for (i = 0; i < num_threads; i++) {
+        JobWorker *w = &runner.workers[i];
+        minor_gc += w->ctx->num_minor_gc;
+        major_gc += w->ctx->num_major_gc;
+        pthread_mutex_destroy(&w->lock);
+        vm = w->ctx;
+#ifdef CLAMB_TRACE
+        trace_close();
+#endif
+        if (trace_file)
+            free(w->ctx->trace_file);
+        if (w->ctx != ctx)
+            clamb_free(w->ctx);
+    }
+    vm = ctx;
+    ctx->trace_file = trace_file;
+    if (ctx->verbosity >= V_STATS) {
+        double time = wall_clock() - start;
+        fprintf(stderr, "%d records (%d failed), %ld reductions, %d threads\n",
+                runner.num_jobs, runner.failed, reductions, num_threads);
+        fprintf(stderr, "  total wall time --- %5.2f sec.\n", time);
+        fprintf(stderr, "  time per record --- %5.3f msec.\n",
+                runner.num_jobs ? time * 1000 / runner.num_jobs : 0.0);
+        fprintf(stderr, "  gc count        --- %d minor, %d major\n",
+                minor_gc, major_gc);
+    }
+    pthread_mutex_destroy(&runner.out_lock);
+    free(runner.workers);
+    free(runner.jobs);
+    return runner.failed ? 1 : 0;
+}
+
+/* Loads the program of -b or -l from the file at path alone. */
+void batch_load(const char *path)
+{
+    Clamb *ctx = vm;
+    RecordReader *r;
+    double start = wall_clock();
+
+    if ((r = calloc(1, sizeof(RecordReader))) == NULL)
+        errexit("Cannot allocate record reader\n");
+    if ((r->fd = open(path, O_RDONLY)) < 0)
+        errexit("cannot open %s\n", path);
+    clamb_set_input(ctx, record_read, r);
+    if (clamb_load(ctx, NULL, 0) < 0)
+        errexit("%s: %s\n", path, clamb_error(ctx));
+    /* anything after the program is not part of a record */
+    input_close();
+    input_init(NULL);
+    clamb_set_input(ctx, NULL, NULL);
+    close(r->fd);
+    free(r);
+    if (ctx->verbosity >= V_STATS)
+        fprintf(stderr, "program loaded in %.3f sec. (%d cells)\n",
+                wall_clock() - start, ctx->template->size);
+}
+
+int batch(char **files, int num_threads)
+{
+    Clamb *ctx = vm;
+    RecordReader *r;
+    char name[32];
+    double start;
+    long reductions = 0;
+    int records = 0, failed = 0;
+
+    if (*files == NULL)
+        errexit("batch mode requires a program file\n");
+    batch_load(*files);
+    if (num_threads > 1)
+        return run_jobs(files + 1, num_threads);
+    if ((r = calloc(1, sizeof(RecordReader))) == NULL)
+        errexit("Cannot allocate record reader\n");
+
+    start = wall_clock();
+    if (*++files) {
+        for (; *files; files++, records++) {
+            memset(r, 0, sizeof(RecordReader));
+            if ((r->fd = open(*files, O_RDONLY)) < 0) {
+                fprintf(stderr, "cannot open %s\n", *files);
+                failed++;
+                continue;
             }
+            if (run_record(r, *files) < 0)
+                failed++;
+            reductions += ctx->reductions;
+            close(r->fd);
         }
-        else if (isint(TOP) && APPLICABLE(1))
-            errexit("invalid output format (attempted to apply a number)\n");
+    } else {
+        r->fd = 0;
+        r->delimited = 1;
+        while (record_fill(r)) {
+            snprintf(name, sizeof(name), "record %d", ++records);
+            if (run_record(r, name) < 0)
+                failed++;
+            reductions += ctx->reductions;
+            record_skip(r);
+            r->eor = 0;
+        }
+    }
+
+    if (ctx->verbosity >= V_STATS) {
+        double time = wall_clock() - start;
+        fprintf(stderr, "%d records (%d failed), %ld reductions\n",
+                records, failed, reductions);
+        fprintf(stderr, "  total eval time --- %5.2f sec.\n", time);
+        fprintf(stderr, "  time per record --- %5.3f msec.\n",
+                records ? time * 1000 / records : 0.0);
+        fprintf(stderr, "  total gc time   --- %5.2f sec.\n", ctx->total_gc_time);
+        fprintf(stderr, "  gc count        --- %d minor, %d major\n",
+                ctx->num_minor_gc, ctx->num_major_gc);
+    }
+#ifdef CLAMB_TRACE
+    trace_close();
+#endif
+    free(r);
+    return failed ? 1 : 0;
+}
+
+/* Server mode (-l) runs the program once for each connection, with the
+ * connection as its input and output. Sessions are clones of the loaded
+ * context, time-sliced by a pool of threads with clamb_step: a session
+ * that used up its quantum goes to the back of the run queue, and one
+ * that waits for input or for its output to drain is handed to the epoll
+ * loop of the main thread, which queues it again when the socket is
+ * ready. An idle session costs only its heap. The epoll registration is
+ * one-shot, so a session is owned by one thread at a time. When accept
+ * runs out of file descriptors, the listening socket leaves the epoll set
+ * for ACCEPT_BACKOFF milliseconds, since the pending connection would
+ * otherwise wake the loop again at once. */
+
+#define SESSION_OUT_MAX (256*1024)  /* output kept before waiting for it */
+#define ACCEPT_BACKOFF  100         /* ms */
+
+typedef struct Session {
+    int fd;
+    int registered;             /* with the epoll set */
+    int finished;
+    Clamb *ctx;
+    unsigned char *out;         /* unsent output is out[out_pos..out_len) */
+    size_t out_pos, out_len, out_size;
+    struct Session *next;       /* in the run queue */
+    char name[64];
+} Session;
+
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    Clamb *program;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Session *head, *tail;       /* the run queue */
+    int accept_paused;          /* the listening socket is not polled */
+    double accept_resume;       /* wall_clock at which it is again */
+    int accept_logged;          /* the failure has been reported */
+} Server;
+
+int session_read(void *arg, unsigned char *buf, int size)
+{
+    Session *session = arg;
+
+    for (;;) {
+        ssize_t n = recv(session->fd, buf, size, MSG_DONTWAIT);
+        if (n >= 0)
+            return n;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return CLAMB_WOULDBLOCK;
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+int session_write(void *arg, const unsigned char *buf, int size)
+{
+    Session *session = arg;
+
+    if (session->out_pos == session->out_len)
+        session->out_pos = session->out_len = 0;
+    if (session->out_len + size > session->out_size) {
+        size_t n = session->out_size ? session->out_size : OUTPUT_BUFSIZE;
+        unsigned char *out;
+        while (n < session->out_len + size)
+            n *= 2;
+        if ((out = realloc(session->out, n)) == NULL)
+            return -1;
+        session->out = out;
+        session->out_size = n;
+    }
+    memcpy(session->out + session->out_len, buf, size);
+    session->out_len += size;
+    return 0;
+}
+
+/* Sends what the socket takes of the pending output. Returns -1 if the
+ * connection is broken. */
+int session_flush(Session *session)
+{
+    while (session->out_pos < session->out_len) {
+        ssize_t n = send(session->fd, session->out + session->out_pos,
+                         session->out_len - session->out_pos,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno != EINTR)
+                return -1;
+        } else
+            session->out_pos += n;
+    }
+    return 0;
+}
+
+void session_close(Session *session)
+{
+    close(session->fd);
+    clamb_free(session->ctx);
+    free(session->out);
+    free(session);
+}
+
+void session_enqueue(Server *server, Session *session)
+{
+    pthread_mutex_lock(&server->lock);
+    session->next = NULL;
+    if (server->tail)
+        server->tail->next = session;
+    else
+        server->head = session;
+    server->tail = session;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Hands the session to the epoll loop until the socket is ready for
+ * events. */
+void session_wait(Server *server, Session *session, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = session;
+    if (epoll_ctl(server->epoll_fd,
+                  session->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  session->fd, &ev) < 0) {
+        fprintf(stderr, "%s: epoll_ctl: %s\n", session->name, strerror(errno));
+        session_close(session);
+        return;
+    }
+    session->registered = 1;
+}
+
+/* Gives the session a turn. */
+void session_run(Server *server, Session *session)
+{
+    size_t pending;
+    int status;
+
+    if (session_flush(session) < 0) {
+        session_close(session);
+        return;
+    }
+    pending = session->out_len - session->out_pos;
+    if (session->finished) {
+        if (pending)
+            session_wait(server, session, EPOLLOUT);
         else
-            return;
-        reductions++;
+            session_close(session);
+        return;
+    }
+    if (pending > SESSION_OUT_MAX) {
+        session_wait(server, session, EPOLLOUT);
+        return;
+    }
+
+    status = clamb_step(session->ctx);
+    if (status < 0)
+        fprintf(stderr, "%s: %s\n", session->name, clamb_error(session->ctx));
+    if (session_flush(session) < 0) {
+        session_close(session);
+        return;
+    }
+    pending = session->out_len - session->out_pos;
+    switch (status) {
+    case CLAMB_YIELDED:
+        session_enqueue(server, session);
+        break;
+    case CLAMB_BLOCKED:
+        /* the peer may be waiting for the output before it sends more */
+        session_wait(server, session, EPOLLIN | (pending ? EPOLLOUT : 0));
+        break;
+    default:
+        if (session->ctx->verbosity >= V_STATS)
+            fprintf(stderr, "%s: %lld reductions\n", session->name,
+                    session->ctx->reductions);
+        session->finished = 1;
+        if (pending)
+            session_wait(server, session, EPOLLOUT);
+        else
+            session_close(session);
     }
 }
 
-void eval_print(Cell root)
+void *server_worker(void *arg)
 {
-    eval(pair(COMB_WRITE,
-              pair(root,
-                   pair(COMB_READ, NIL))));
+    Server *server = arg;
+
+    for (;;) {
+        Session *session;
+        pthread_mutex_lock(&server->lock);
+        while (server->head == NULL)
+            pthread_cond_wait(&server->ready, &server->lock);
+        session = server->head;
+        if ((server->head = session->next) == NULL)
+            server->tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+        session_run(server, session);
+    }
+    return NULL;
 }
 
-/**********************************************************************
- *  Main
- **********************************************************************/
+/* Adds the listening socket to the epoll set, or removes it for
+ * ACCEPT_BACKOFF milliseconds. */
+void server_poll_listener(Server *server, int on)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(server->epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                  server->listen_fd, &ev) < 0)
+        errexit("epoll_ctl: %s\n", strerror(errno));
+    server->accept_paused = !on;
+    server->accept_resume = wall_clock() + ACCEPT_BACKOFF / 1000.0;
+}
+
+void server_accept(Server *server)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    Session *session;
+    int fd;
+
+    while ((fd = accept(server->listen_fd, (struct sockaddr *)&addr,
+                        &len)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if ((session = calloc(1, sizeof(Session))) == NULL ||
+            (session->ctx = clamb_clone(server->program)) == NULL) {
+            fprintf(stderr, "Cannot allocate a session\n");
+            free(session);
+            close(fd);
+            continue;
+        }
+        session->fd = fd;
+        if (getnameinfo((struct sockaddr *)&addr, len, host, sizeof(host),
+                        port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV))
+            strcpy(host, "?"), strcpy(port, "?");
+        snprintf(session->name, sizeof(session->name), "%s:%s", host, port);
+        clamb_set_input(session->ctx, session_read, session);
+        clamb_set_output(session->ctx, session_write, session);
+        session_enqueue(server, session);
+        len = sizeof(addr);
+    }
+    if (errno == EMFILE || errno == ENFILE) {
+        if (!server->accept_logged)
+            fprintf(stderr, "accept: %s (retrying every %d ms)\n",
+                    strerror(errno), ACCEPT_BACKOFF);
+        server->accept_logged = 1;
+        server_poll_listener(server, 0);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        server->accept_logged = 0;
+    } else if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+    }
+}
+
+/* Listens on addr, given as [host:]port. */
+int server_listen(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    int fd = -1, one = 1, err;
+
+    if (port) {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+        port++;
+    } else {
+        host[0] = '\0';
+        port = addr;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) != 0)
+        errexit("%s: %s\n", addr, gai_strerror(err));
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        errexit("cannot listen on %s: %s\n", addr, strerror(errno));
+    return fd;
+}
+
+int serve(const char *addr, char **files, int num_threads)
+{
+    Server server;
+    struct epoll_event events[64];
+    pthread_t thread;
+    int i, n;
+
+    if (files[0] == NULL || files[1] != NULL)
+        errexit("server mode requires one program file\n");
+    memset(&server, 0, sizeof(server));
+    server.program = vm;
+    batch_load(files[0]);
+    server.listen_fd = server_listen(addr);
+    if ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        errexit("epoll_create1: %s\n", strerror(errno));
+    server_poll_listener(&server, 1);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&thread, NULL, server_worker, &server) != 0)
+            errexit("Cannot create server thread\n");
+        pthread_detach(thread);
+    }
+    if (vm->verbosity >= V_STATS)
+        fprintf(stderr, "listening on %s with %d threads\n", addr, num_threads);
+
+    for (;;) {
+        if ((n = epoll_wait(server.epoll_fd, events, 64,
+                            server.accept_paused ? ACCEPT_BACKOFF : -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errexit("epoll_wait: %s\n", strerror(errno));
+        }
+        if (server.accept_paused && wall_clock() >= server.accept_resume) {
+            server_poll_listener(&server, 1);
+            server_accept(&server);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                server_accept(&server);
+            else
+                session_enqueue(&server, events[i].data.ptr);
+        }
+    }
+}
+
+/* Writes the statistics of the run to the file of -M ("-" for stderr) as
+ * a JSON object. Times are in seconds: eval excludes the collections,
+ * which gc sums up for both the load and the evaluation. */
+void stats_write(int program_size, double load_time, double eval_time,
+                 double total_time)
+{
+    FILE *fp = strcmp(vm->stats_file, "-") == 0 ? stderr :
+        fopen(vm->stats_file, "w");
+    long allocated = vm->allocated + (vm->free_ptr - vm->nursery);
+    struct rusage usage;
+    int i, first = 1;
+
+    if (fp == NULL)
+        errexit("cannot open %s: %s\n", vm->stats_file, strerror(errno));
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fp, "{\n  \"version\": \"%s\",\n", VERSION);
+    fprintf(fp, "  \"engine\": \"%s\",\n", engine_names[vm->engine]);
+    fprintf(fp, "  \"reductions\": %lld,\n", vm->reductions);
+    fprintf(fp, "  \"program_cells\": %d,\n", program_size);
+    fprintf(fp, "  \"time\": {\"wall\": %.6f, \"cpu\": %.6f, "
+            "\"load\": %.6f, \"parse\": %.6f, \"translate\": %.6f, "
+            "\"eval\": %.6f, \"gc\": %.6f},\n", total_time, cpu_clock(),
+            load_time, vm->parse_time, vm->translate_time, eval_time,
+            vm->total_gc_time);
+    fprintf(fp, "  \"gc\": {\"minor\": %d, \"major\": %d, "
+            "\"pause_p50\": %.6f, \"pause_p99\": %.6f, \"pause_max\": %.6f,\n"
+            "         \"pause_histogram\": [", vm->num_minor_gc,
+            vm->num_major_gc, gc_pause_quantile(vm, 0.5),
+            gc_pause_quantile(vm, 0.99), vm->max_gc_pause);
+    for (i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (vm->gc_pauses[i] == 0)
+            continue;
+        fprintf(fp, "%s[%.6f, %d]", first ? "" : ", ", gc_pause_limit(i),
+                vm->gc_pauses[i]);
+        first = 0;
+    }
+    fprintf(fp, "]},\n");
+    fprintf(fp, "  \"alloc\": {\"cells\": %ld, \"bytes\": %ld, "
+            "\"bytes_per_sec\": %.0f, \"minor_survival\": %.4f, "
+            "\"major_survival\": %.4f},\n", allocated,
+            allocated * (long)sizeof(Pair),
+            eval_time > 0 ? allocated * (double)sizeof(Pair) / eval_time : 0.0,
+            vm->allocated ? (double)vm->promoted / vm->allocated : 0.0,
+            vm->major_scanned ? (double)vm->major_alive / vm->major_scanned : 0.0);
+    fprintf(fp, "  \"heap\": {\"max_cells\": %d, \"max_live\": %d, "
+            "\"max_stack\": %d},\n", heap_peak(), vm->max_alive,
+            rs_max_depth());
+    fprintf(fp, "  \"rss_peak_bytes\": %ld,\n", usage.ru_maxrss * 1024L);
+    fprintf(fp, "  \"page_faults\": {\"minor\": %ld, \"major\": %ld}\n}\n",
+            usage.ru_minflt, usage.ru_majflt);
+    if (fp != stderr && fclose(fp) != 0)
+        errexit("cannot write %s: %s\n", vm->stats_file, strerror(errno));
+}
 
 void help(const char *progname) {
     printf("Usage: %s [options] input-file...\n", progname);
+    printf("       %s -b [-j N] [options] program-file [record-file...]\n",
+           progname);
+    printf("       %s -l [host:]port [-j N] [options] program-file\n", progname);
     printf("  -h       print this help and exit\n");
-    printf("  -u       disable stdout buffering\n");
+    printf("  -b       run the program once for each record (see README)\n");
+    printf("  -j N     run the records of -b, or the sessions of -l, on N threads\n");
+    printf("  -l ADDR  serve the program on [host:]port (see README)\n");
+    printf("  -u       disable output buffering (-X flush=byte)\n");
     printf("  -p       parse the program, print it and exit\n");
+    printf("  -k       use Kiselyov's bracket abstraction\n");
+    printf("  -s       share identical subterms of the program\n");
+    printf("  -L       translate parts of the program when first used\n");
+    printf("  -e ENGINE  evaluate with graph (the default) or kam (see README)\n");
+    printf("  -c FILE  cache the translated program in FILE\n");
+    printf("  -S FILE  snapshot the evaluation before the first I/O in FILE\n");
+    printf("  -T FILE  trace the reductions in FILE (see README)\n");
+    printf("  -M FILE  write statistics of the run to FILE as JSON\n");
+    printf("  -X NAME=VALUE  set a tuning parameter (see README)\n");
     printf("  -v       print version and exit\n");
-    printf("  -v[0-2]  set verbosity level (default: 0)\n");
+    printf("  -v[0-3]  set verbosity level (default: 0)\n");
 }
 
 int main(int argc, char *argv[])
 {
-    Cell root;
-    clock_t start;
+    Cell root = NIL, *bottom = NULL;
+    double start, load_time, load_gc_time, eval_time, run_start = wall_clock();
+    int program_size = 0;
     int i;
     int parse_only = 0;
-    
+    int batch_mode = 0, num_threads = 1;
+    const char *listen_addr = NULL;
+
+    if ((vm = clamb_new()) == NULL)
+        errexit("Cannot allocate interpreter state\n");
+    getenv_tunables();
     for (i = 1; i < argc && argv[i][0] == '-'; i++) {
         if (argv[i][1] == 'v' && isdigit(argv[i][2])) {
-            verbosity = argv[i][2] - '0';
+            vm->verbosity = argv[i][2] - '0';
         } else if (strcmp(argv[i], "-h") == 0) {
             help(argv[0]);
             return 0;
         } else if (strcmp(argv[i], "-p") == 0) {
             parse_only = 1;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batch_mode = 1;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            if (++i == argc)
+                errexit("option -l requires an address\n");
+            listen_addr = argv[i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (++i == argc || (num_threads = atoi(argv[i])) < 1)
+                errexit("option -j requires a number of threads\n");
+        } else if (strcmp(argv[i], "-k") == 0) {
+            vm->kiselyov_mode = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            vm->share_mode = 1;
+        } else if (strcmp(argv[i], "-L") == 0) {
+            vm->lazy_mode = 1;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            if (++i == argc)
+                errexit("option -e requires an engine\n");
+            for (vm->engine = 0; engine_names[vm->engine] &&
+                 strcmp(argv[i], engine_names[vm->engine]) != 0; vm->engine++)
+                ;
+            if (engine_names[vm->engine] == NULL)
+                errexit("unknown engine '%s' for -e\n", argv[i]);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            if (++i == argc)
+                errexit("option -c requires a file name\n");
+            vm->cache_file = argv[i];
+        } else if (strcmp(argv[i], "-S") == 0) {
+            if (++i == argc)
+                errexit("option -S requires a file name\n");
+            vm->snapshot_file = argv[i];
+        } else if (strcmp(argv[i], "-T") == 0) {
+            if (++i == argc)
+                errexit("option -T requires a file name\n");
+#ifndef CLAMB_TRACE
+            errexit("-T needs a build with -DCLAMB_TRACE\n");
+#endif
+            vm->trace_file = argv[i];
+        } else if (strcmp(argv[i], "-M") == 0) {
+            if (++i == argc)
+                errexit("option -M requires a file name\n");
+            vm->stats_file = argv[i];
+        } else if (strcmp(argv[i], "-X") == 0) {
+            if (++i == argc)
+                errexit("option -X requires a parameter\n");
+            set_tunable(argv[i]);
         } else if (strcmp(argv[i], "-u") == 0) {
             setbuf(stdout, NULL);
+            vm->flush_policy = FLUSH_BYTE;
         } else if (strcmp(argv[i], "-v") == 0) {
             printf("Universal Lambda interpreter " VERSION " by irori\n");
             return 0;
@@ -687,26 +5732,110 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (vm->engine == ENGINE_KAM && (vm->trace_file || vm->snapshot_file))
+        errexit("-e kam cannot be used with -T or -S\n");
+    if (vm->trace_file) {
+        if (listen_addr || vm->snapshot_file)
+            errexit("-T cannot be used with -l or -S\n");
+        vm->lazy_mode = 0;      /* see REDUCTION TRACE */
+    }
+    if (batch_mode || listen_addr) {
+        if (parse_only || vm->cache_file || vm->snapshot_file || vm->stats_file)
+            errexit("-b and -l cannot be used with -p, -c, -S or -M\n");
+        if (batch_mode && listen_addr)
+            errexit("-b and -l cannot be used together\n");
+        if (listen_addr)
+            return serve(listen_addr, argv + i, num_threads);
+        return batch(argv + i, num_threads);
+    }
+    if (num_threads > 1)
+        errexit("-j can only be used with -b or -l\n");
+
+    if (parse_only) {
+        vm->lazy_mode = 0;      /* print the whole translation */
+        vm->engine = ENGINE_GRAPH;
+    }
     input_init(argv + i);
-    storage_init(INITIAL_HEAP_SIZE);
+    storage_init(vm->heap_initial);
     rs_init();
 
-    root = load_program();
+    start = wall_clock();
+    if (vm->snapshot_file && !parse_only)
+        bottom = snapshot_load(vm->snapshot_file);
+    if (bottom == NULL) {
+        if (!vm->cache_file || !image_load(vm->cache_file, &root)) {
+            root = load_program();
+            if (vm->share_mode)
+                root = share(root, gc_full(&root));
+            if (vm->cache_file)
+                image_save(vm->cache_file, &root, NULL);
+        }
+        if (vm->verbosity >= V_STATS || vm->trace_file || vm->stats_file)
+            program_size = gc_full(&root);
+        vm->snapshot_pending = vm->snapshot_file != NULL;
+    }
+    load_time = wall_clock() - start;
+    load_gc_time = vm->total_gc_time;
     if (parse_only) {
         unparse(root);
         return 0;
     }
 
-    start = clock();
-    eval_print(root);
+#ifdef CLAMB_TRACE
+    if (vm->trace_file)
+        trace_run(root, vm->old_area, program_size);
+#endif
+    start = wall_clock();
+    if (bottom)
+        eval_all(STACK_TOP, bottom);    /* resume the snapshot */
+    else if (vm->engine == ENGINE_KAM)
+        kam_print(root);
+    else
+        eval_print(root);
+#ifdef CLAMB_TRACE
+    trace_close();
+#endif
 
-    if (verbosity >= V_STATS) {
-        double evaltime = (clock() - start) / (double)CLOCKS_PER_SEC;
+    eval_time = wall_clock() - start - (vm->total_gc_time - load_gc_time);
+    if (vm->stats_file)
+        stats_write(program_size, load_time, eval_time, wall_clock() - run_start);
+    if (vm->verbosity >= V_STATS) {
+        double gctime = vm->total_gc_time - load_gc_time;
+        struct rusage usage;
 
-        printf("\n%d reductions\n", reductions);
-        printf("  total eval time --- %5.2f sec.\n", evaltime - total_gc_time);
-        printf("  total gc time   --- %5.2f sec.\n", total_gc_time);
+        printf("\n%lld reductions\n", vm->reductions);
+        printf("  program size    --- %d cells\n", program_size);
+        printf("  total load time --- %5.2f sec.\n", load_time);
+        printf("  total eval time --- %5.2f sec.\n", eval_time);
+        printf("  total gc time   --- %5.2f sec.\n", gctime);
+        printf("  gc count        --- %d minor, %d major\n",
+               vm->num_minor_gc, vm->num_major_gc);
+        printf("  max gc pause    --- %5.3f sec.\n", vm->max_gc_pause);
         printf("  max stack depth --- %d\n", rs_max_depth());
+        printf("  max heap size   --- %d cells, %d live\n", heap_peak(),
+               vm->max_alive);
+        printf("  allocated       --- %ld cells, %.1f%% promoted\n",
+               vm->allocated + (vm->free_ptr - vm->nursery), vm->allocated ?
+               100.0 * vm->promoted / vm->allocated : 0.0);
+        if (vm->lazy_mode)
+            printf("  lazy thunks     --- %d translated\n",
+                   vm->lazy_translations);
+        if (vm->jit_threshold)
+            printf("  compiled terms  --- %d, %.1f%% of the reductions\n",
+                   vm->jit_compiled, vm->reductions ?
+                   100.0 * vm->jit_reductions / vm->reductions : 0.0);
+        getrusage(RUSAGE_SELF, &usage);
+        printf("  page faults     --- %ld minor, %ld major\n",
+               usage.ru_minflt, usage.ru_majflt);
+        if (vm->verbosity >= V_PROFILE) {
+#ifdef CLAMB_PROFILE
+            profile_print();
+#else
+            printf("  (build with -DCLAMB_PROFILE for a profile of the rules)\n");
+#endif
+        }
     }
     return 0;
 }
+
+#endif /* CLAMB_LIBRARY */
@@ -0,0 +1,100 @@
+/*
+ * clamb - Universal Lambda interpreter, library interface
+ *
+ * A Clamb context is an interpreter with its own heap, stack and I/O.
+ * Any number of contexts can be used in one process, each by one thread
+ * at a time. Build libclamb.a with "make libclamb.a".
+ *
+ *     Clamb *vm = clamb_new();
+ *     clamb_set_input(vm, my_read, my_data);
+ *     clamb_set_output(vm, my_write, my_data);
+ *     if (clamb_load(vm, program, program_size) < 0 || clamb_run(vm) < 0)
+ *         fprintf(stderr, "%s\n", clamb_error(vm));
+ *     clamb_free(vm);
+ */
+
+#ifndef CLAMB_H
+#define CLAMB_H
+
+#include <stddef.h>
+
+typedef struct Clamb Clamb;
+
+/* Reads up to size bytes of input into buf. Returns the number of bytes
+ * read, 0 at the end of the input, -1 on error, or CLAMB_WOULDBLOCK when
+ * no input is available yet (see clamb_step). */
+typedef int (*ClambReadFn)(void *arg, unsigned char *buf, int size);
+#define CLAMB_WOULDBLOCK        (-2)
+
+/* results of clamb_step and clamb_run besides 0 and -1 */
+#define CLAMB_YIELDED           1
+#define CLAMB_BLOCKED           2
+
+/* Writes size bytes of output. Returns 0, or -1 on error. */
+typedef int (*ClambWriteFn)(void *arg, const unsigned char *buf, int size);
+
+typedef struct {
+    long reductions;            /* of the last run */
+    int minor_gc, major_gc;     /* collections since clamb_load */
+    double gc_time;             /* seconds spent in them */
+    double max_gc_pause;
+    double gc_pause_p50, gc_pause_p99;  /* estimated from a histogram */
+    int max_stack_depth;        /* cells */
+    int heap_size;              /* current size of the old generation */
+    int max_heap_size;          /* its largest size since clamb_load */
+    int max_live_cells;         /* the most left by a major collection */
+    long allocated_cells;       /* since clamb_load */
+    long promoted_cells;        /* of them, copied to the old generation */
+} ClambStats;
+
+/* Returns a new context, or NULL when out of memory. The heap is
+ * allocated by the first clamb_load. */
+Clamb *clamb_new(void);
+
+/* Returns a new context with the parameters, the I/O functions and the
+ * loaded program of vm, or NULL when out of memory. The program is shared,
+ * not copied, so each thread of a server can run it in a clone of its own
+ * while costing one translation. */
+Clamb *clamb_clone(const Clamb *vm);
+
+void clamb_free(Clamb *vm);
+
+/* Sets a parameter given as "name=value", as with the -X option of the
+ * clamb command; "kiselyov=1", "share=1" and "lazy=1" select -k, -s and
+ * -L, and "engine=kam" the Krivine machine of -e kam. Heap parameters
+ * take effect at the first clamb_load. Returns 0, or -1 on error. */
+int clamb_option(Clamb *vm, const char *option);
+
+/* The input of the program is read with fn after the bytes that follow
+ * the program in the buffer given to clamb_load. Without a function the
+ * program sees the end of input there. */
+void clamb_set_input(Clamb *vm, ClambReadFn fn, void *arg);
+
+/* The output of the program goes to fn, or to stdout when fn is NULL,
+ * in the writes the flush parameters ask for. */
+void clamb_set_output(Clamb *vm, ClambWriteFn fn, void *arg);
+
+/* Parses and translates the program at the start of buf, discarding
+ * everything left in the heap by previous programs. Returns 0, or -1 on
+ * error. */
+int clamb_load(Clamb *vm, const void *buf, size_t size);
+
+/* Runs the loaded program until it finishes. A program can be run any
+ * number of times: each run starts from a fresh copy of the translated
+ * program in an emptied heap, and reads its input afresh from the input
+ * function. Returns 0, or -1 on error. If the input function returns
+ * CLAMB_WOULDBLOCK, the run is suspended and CLAMB_BLOCKED returned;
+ * calling clamb_run or clamb_step again resumes it. */
+int clamb_run(Clamb *vm);
+
+/* Runs the program like clamb_run but for at most about "quantum"
+ * reductions (a parameter, 100000 by default), then returns CLAMB_YIELDED
+ * with the run suspended. This lets one thread time-slice many contexts. */
+int clamb_step(Clamb *vm);
+
+/* Returns the message of the last error. */
+const char *clamb_error(const Clamb *vm);
+
+void clamb_get_stats(const Clamb *vm, ClambStats *stats);
+
+#endif
@@ -0,0 +1,462 @@
+/*
+ *  Reports on the reduction traces written by clamb -T
+ *
+ *  Copyright 2008-2024 irori <irorin@gmail.com>
+ *  This code is licensed under the MIT License (see LICENSE file for details).
+ *
+ *  Usage: tracedump [-n N] [-w WIDTH] trace-file...
+ *
+ *  The files must be traces of the same program, such as the FILE.N of
+ *  the threads of clamb -b -j. Their events are added up into:
+ *  - the reductions of each rule, and how many of them were at a node of
+ *    the program rather than at one created by the reduction;
+ *  - the depth of the stack over the course of the trace;
+ *  - the N program nodes with the most reductions (hot nodes);
+ *  - the N subterms with the most reductions, counting together all the
+ *    nodes of the program that have the same subterm (hot subterms). A
+ *    subterm that was reduced at several copies has lost its sharing.
+ *  Subterms are printed as by clamb -p, cut to WIDTH characters.
+ *
+ *  See REDUCTION TRACE in clamb.c for the format of the file.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TRACE_MAGIC     "CLAMBTRC"
+#define TRACE_VERSION   1
+#define TRACE_HEAP      0xffffffff
+#define MAX_RULES       256
+#define NUM_SLICES      32      /* rows of the stack depth report */
+
+enum { TRACE_PROGRAM = 1, TRACE_RUN, TRACE_EVENTS };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_rules;
+} TraceHeader;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t count;
+} TraceBlock;
+
+typedef struct {
+    uint32_t info;              /* rule << 24 | stack depth */
+    uint32_t node;
+} TraceEvent;
+
+/* cells as in the trace: a pair is its index shifted over the tag */
+#define ispair(c)       (((c) & 3) == 0)
+#define indexof(c)      ((c) >> 2)
+#define iscomb(c)       (((c) & 3) == 2)
+#define combof(c)       ((int64_t)(c) >> 2)
+#define ischar(c)       (((c) & 7) == 3)
+#define charof(c)       ((int64_t)(c) >> 3)
+
+typedef struct {
+    uint64_t count, sum, max;   /* of the stack depths */
+} Slice;
+
+char *rule_names[MAX_RULES];
+int num_rules;
+uint64_t rule_count[MAX_RULES], rule_program[MAX_RULES];
+
+uint64_t *cells;                /* car and cdr of each program cell */
+uint64_t num_cells, root;
+uint64_t *node_count;
+
+uint64_t num_events, num_runs, max_depth, depth_sum;
+Slice slices[NUM_SLICES];
+int num_slices;
+uint64_t slice_size = 1024;     /* events per slice, doubled as needed */
+
+int width = 60;
+
+void errexit(const char *fmt, const char *arg)
+{
+    fprintf(stderr, fmt, arg);
+    exit(1);
+}
+
+void *xmalloc(size_t size)
+{
+    void *p = calloc(1, size ? size : 1);
+    if (p == NULL)
+        errexit("out of memory%s\n", "");
+    return p;
+}
+
+void read_exact(FILE *fp, void *buf, size_t size, const char *path)
+{
+    if (fread(buf, 1, size, fp) != size)
+        errexit("%s: unexpected end of file\n", path);
+}
+
+/* Adds the depth of an event to the timeline, halving its resolution
+ * when all slices are full. */
+void slice_add(uint64_t depth)
+{
+    Slice *s;
+    int i;
+
+    if (num_slices == 0 || slices[num_slices - 1].count == slice_size) {
+        if (num_slices == NUM_SLICES) {
+            for (i = 0; i < NUM_SLICES / 2; i++) {
+                Slice *a = &slices[2 * i], *b = &slices[2 * i + 1];
+                slices[i].count = a->count + b->count;
+                slices[i].sum = a->sum + b->sum;
+                slices[i].max = a->max > b->max ? a->max : b->max;
+            }
+            num_slices = NUM_SLICES / 2;
+            slice_size *= 2;
+        }
+        if (num_slices == 0 || slices[num_slices - 1].count == slice_size)
+            memset(&slices[num_slices++], 0, sizeof(Slice));
+    }
+    s = &slices[num_slices - 1];
+    s->count++;
+    s->sum += depth;
+    if (depth > s->max)
+        s->max = depth;
+}
+
+void read_program(FILE *fp, uint32_t count, const char *path)
+{
+    uint64_t *p = xmalloc(sizeof(uint64_t) * (2 * (size_t)count + 1));
+
+    read_exact(fp, p, sizeof(uint64_t) * (2 * (size_t)count + 1), path);
+    if (cells == NULL) {
+        cells = p;
+        num_cells = count;
+        root = p[2 * (size_t)count];
+        node_count = xmalloc(sizeof(uint64_t) * num_cells);
+        return;
+    }
+    if (count != num_cells ||
+        memcmp(p, cells, sizeof(uint64_t) * (2 * (size_t)count + 1)) != 0)
+        errexit("%s: trace of another program\n", path);
+    free(p);
+}
+
+void read_events(FILE *fp, uint32_t count, const char *path)
+{
+    TraceEvent buf[4096];
+    uint32_t i, j, len;
+
+    for (i = 0; i < count; i += len) {
+        len = count - i < 4096 ? count - i : 4096;
+        read_exact(fp, buf, sizeof(TraceEvent) * len, path);
+        for (j = 0; j < len; j++) {
+            int rule = buf[j].info >> 24;
+            uint64_t depth = buf[j].info & 0xffffff;
+            if (rule >= num_rules)
+                errexit("%s: broken event\n", path);
+            rule_count[rule]++;
+            if (buf[j].node != TRACE_HEAP) {
+                if (buf[j].node >= num_cells)
+                    errexit("%s: broken event\n", path);
+                node_count[buf[j].node]++;
+                rule_program[rule]++;
+            }
+            depth_sum += depth;
+            if (depth > max_depth)
+                max_depth = depth;
+            slice_add(depth);
+        }
+        num_events += len;
+    }
+}
+
+void read_trace(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    TraceHeader h;
+    TraceBlock b;
+    char name[64];
+    int i, j, c;
+
+    if (fp == NULL)
+        errexit("cannot open %s\n", path);
+    read_exact(fp, &h, sizeof(h), path);
+    if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != TRACE_VERSION || h.num_rules > MAX_RULES)
+        errexit("%s: not a clamb trace\n", path);
+    if (num_rules && (int)h.num_rules != num_rules)
+        errexit("%s: trace of another build\n", path);
+    num_rules = h.num_rules;
+    for (i = 0; i < num_rules; i++) {
+        for (j = 0; (c = getc(fp)) > 0; j++) {
+            if (j < (int)sizeof(name) - 1)
+                name[j] = c;
+        }
+        if (c == EOF)
+            errexit("%s: unexpected end of file\n", path);
+        name[j < (int)sizeof(name) ? j : (int)sizeof(name) - 1] = '\0';
+        if (rule_names[i] == NULL)
+            rule_names[i] = strdup(name);
+    }
+
+    while (fread(&b, sizeof(b), 1, fp) == 1) {
+        if (b.kind == TRACE_PROGRAM)
+            read_program(fp, b.count, path);
+        else if (b.kind == TRACE_RUN)
+            num_runs++;
+        else if (b.kind == TRACE_EVENTS && cells)
+            read_events(fp, b.count, path);
+        else
+            errexit("%s: broken block\n", path);
+    }
+    fclose(fp);
+}
+
+/* Prints at most width characters of the subterm at c. */
+void print_term(uint64_t c)
+{
+    uint64_t *stack = xmalloc(sizeof(uint64_t) * (width + 1));
+    char buf[64];
+    int sp = 0, n = 0, len, cut = 0;
+
+    stack[sp++] = c;
+    while (sp > 0 && n < width) {
+        c = stack[--sp];
+        if (ispair(c) && indexof(c) < num_cells) {
+            putchar('`');
+            n++;
+            if (sp + 2 > width) {
+                cut = 1;        /* the rest would not fit anyway */
+                break;
+            }
+            stack[sp++] = cells[2 * indexof(c) + 1];
+            stack[sp++] = cells[2 * indexof(c)];
+            continue;
+        }
+        if (iscomb(c) && combof(c) < num_rules)
+            snprintf(buf, sizeof(buf), "%s", rule_names[combof(c)]);
+        else if (ischar(c))
+            snprintf(buf, sizeof(buf), "#%d", (int)charof(c));
+        else
+            snprintf(buf, sizeof(buf), "?");
+        len = strlen(buf);
+        if (n + len > width) {
+            cut = 1;
+            break;
+        }
+        fputs(buf, stdout);
+        n += len;
+    }
+    if (cut || sp > 0)
+        fputs("...", stdout);
+    free(stack);
+}
+
+/* Returns the number of the structure of each program cell: two cells
+ * have the same number if their subterms are the same. */
+uint64_t *classify(uint64_t *num_classes)
+{
+    uint64_t *class = xmalloc(sizeof(uint64_t) * num_cells);
+    char *state = xmalloc(num_cells);     /* 0: new, 1: open, 2: done */
+    uint64_t *stack = xmalloc(sizeof(uint64_t) * num_cells);
+    uint64_t size, mask, *table, next = 0, i;
+    size_t sp = 0;
+
+    for (size = 2; size < 2 * num_cells; size *= 2)
+        ;
+    mask = size - 1;
+    table = xmalloc(sizeof(uint64_t) * 3 * size);   /* key pair, class + 1 */
+
+    for (i = 0; i < num_cells; i++) {
+        if (state[i])
+            continue;
+        stack[sp++] = i;
+        state[i] = 1;
+        while (sp > 0) {
+            uint64_t n = stack[sp - 1], key[2], h;
+            int k, pending = 0;
+
+            for (k = 0; k < 2; k++) {
+                uint64_t c = cells[2 * n + k];
+                if (ispair(c) && indexof(c) < num_cells &&
+                    state[indexof(c)] == 0) {
+                    state[indexof(c)] = 1;
+                    stack[sp++] = indexof(c);
+                    pending = 1;
+                }
+            }
+            if (pending)
+                continue;
+            sp--;
+            for (k = 0; k < 2; k++) {
+                uint64_t c = cells[2 * n + k];
+                if (!ispair(c) || indexof(c) >= num_cells)
+                    key[k] = c << 1 | 1;
+                else if (state[indexof(c)] == 2)
+                    key[k] = class[indexof(c)] << 1;
+                else            /* a cycle: only equal to itself */
+                    key[k] = (num_cells + indexof(c)) << 1;
+            }
+            h = (key[0] * 0x9e3779b97f4a7c15 ^ key[1]) * 0xff51afd7ed558ccd;
+            for (h = (h >> 20) & mask; table[3 * h + 2]; h = (h + 1) & mask) {
+                if (table[3 * h] == key[0] && table[3 * h + 1] == key[1])
+                    break;
+            }
+            if (table[3 * h + 2] == 0) {
+                table[3 * h] = key[0];
+                table[3 * h + 1] = key[1];
+                table[3 * h + 2] = ++next;
+            }
+            class[n] = table[3 * h + 2] - 1;
+            state[n] = 2;
+        }
+    }
+    free(table);
+    free(stack);
+    free(state);
+    *num_classes = next;
+    return class;
+}
+
+uint64_t *sort_key;
+
+int by_key(const void *a, const void *b)
+{
+    uint64_t x = sort_key[*(const uint64_t *)a];
+    uint64_t y = sort_key[*(const uint64_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Returns the indexes of the n largest of keys[0 .. size). */
+uint64_t *top(uint64_t *keys, uint64_t size, int *n)
+{
+    uint64_t *order = xmalloc(sizeof(uint64_t) * size), i, len = 0;
+
+    for (i = 0; i < size; i++) {
+        if (keys[i])
+            order[len++] = i;
+    }
+    sort_key = keys;
+    qsort(order, len, sizeof(uint64_t), by_key);
+    if (len < (uint64_t)*n)
+        *n = len;
+    return order;
+}
+
+double percent(uint64_t x, uint64_t total)
+{
+    return total ? 100.0 * x / total : 0.0;
+}
+
+void report(int num_top)
+{
+    uint64_t program = 0, slice_max = 0, num_classes, *class, *order, i;
+    uint64_t *class_count, *class_nodes, *class_reduced, *class_node;
+    int n, r, j;
+
+    for (r = 0; r < num_rules; r++)
+        program += rule_program[r];
+    printf("%lu reductions in %lu runs\n", (unsigned long)num_events,
+           (unsigned long)num_runs);
+    printf("  program size    --- %lu cells\n", (unsigned long)num_cells);
+    printf("  in program      --- %5.1f%% of the reductions\n",
+           percent(program, num_events));
+    printf("  max stack depth --- %lu\n", (unsigned long)max_depth);
+    printf("  avg stack depth --- %.1f\n",
+           num_events ? (double)depth_sum / num_events : 0.0);
+
+    printf("\n  %-12s %12s %6s %12s\n", "rule", "reductions", "",
+           "at program");
+    n = num_rules;
+    order = top(rule_count, num_rules, &n);
+    for (j = 0; j < n; j++) {
+        r = order[j];
+        printf("  %-12s %12lu %5.1f%% %12lu\n", rule_names[r],
+               (unsigned long)rule_count[r], percent(rule_count[r], num_events),
+               (unsigned long)rule_program[r]);
+    }
+    free(order);
+
+    printf("\n  %12s %12s %11s\n", "reductions", "mean depth", "max depth");
+    for (j = 0; j < num_slices; j++) {
+        if (slices[j].max > slice_max)
+            slice_max = slices[j].max;
+    }
+    for (j = 0; j < num_slices; j++) {
+        Slice *s = &slices[j];
+        int bar = slice_max ? (int)(30.0 * s->sum / s->count / slice_max) : 0;
+        printf("  %12lu %12.1f %11lu  ", (unsigned long)(slice_size * j),
+               (double)s->sum / s->count, (unsigned long)s->max);
+        while (bar-- > 0)
+            putchar('#');
+        putchar('\n');
+    }
+
+    printf("\n  %9s %12s %6s  %s\n", "hot node", "reductions", "",
+           "subterm");
+    n = num_top;
+    order = top(node_count, num_cells, &n);
+    for (j = 0; j < n; j++) {
+        printf("  %9lu %12lu %5.1f%%  ", (unsigned long)order[j],
+               (unsigned long)node_count[order[j]],
+               percent(node_count[order[j]], num_events));
+        print_term(order[j] << 2);
+        putchar('\n');
+    }
+    free(order);
+
+    class = classify(&num_classes);
+    class_count = xmalloc(sizeof(uint64_t) * num_classes);
+    class_nodes = xmalloc(sizeof(uint64_t) * num_classes);
+    class_reduced = xmalloc(sizeof(uint64_t) * num_classes);
+    class_node = xmalloc(sizeof(uint64_t) * num_classes);
+    for (i = 0; i < num_cells; i++) {
+        class_count[class[i]] += node_count[i];
+        class_nodes[class[i]]++;
+        if (node_count[i])
+            class_reduced[class[i]]++;
+        class_node[class[i]] = i;
+    }
+    printf("\n  %9s %12s %6s  %s\n", "copies", "reductions", "",
+           "hot subterm");
+    n = num_top;
+    order = top(class_count, num_classes, &n);
+    for (j = 0; j < n; j++) {
+        uint64_t k = order[j];
+        printf("  %4lu/%-4lu %12lu %5.1f%%  ", (unsigned long)class_reduced[k],
+               (unsigned long)class_nodes[k], (unsigned long)class_count[k],
+               percent(class_count[k], num_events));
+        print_term(class_node[k] << 2);
+        putchar('\n');
+    }
+    free(order);
+    free(class_node);
+    free(class_reduced);
+    free(class_nodes);
+    free(class_count);
+    free(class);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, num_top = 20;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            num_top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else
+            errexit("unknown option '%s'\n", argv[i]);
+    }
+    if (i == argc || num_top < 0 || width < 1) {
+        fprintf(stderr, "Usage: %s [-n N] [-w WIDTH] trace-file...\n", argv[0]);
+        return 1;
+    }
+    for (; i < argc; i++)
+        read_trace(argv[i]);
+    if (cells == NULL)
+        errexit("%s: no program in the trace\n", argv[argc - 1]);
+    report(num_top);
+    return 0;
+}